@@ -1,3 +1,4 @@
+#define BRO_IMPLEMENTATION
 #include "bro.hpp"
 
 int main(int argc, const char** argv){
@@ -24,7 +25,7 @@ int main(int argc, const char** argv){
 	std::size_t mod_ix = bro.mod("mod");
 	bro.addFlag("mod", "-lstdc++");
 
-	std::size_t obj_ix = bro.transform("obj", ".o");
+	std::size_t obj_ix = bro.transform("obj", ".o", true);
 	bro.useCmd(obj_ix, cxx_ix, ".cpp");
 	bro.useCmd(obj_ix, cc_ix, ".c");
 
@@ -155,6 +156,85 @@ int main(int argc, const char** argv){
 		run.sync(bro.log, {{"in", {"build/bin/mod"}}});
 	}
 
+	{
+		bro.log.info("NO: {}", 9);
+
+		// Records written after a torn entry have to survive a reload
+		std::filesystem::path path = "build/.test_db";
+		std::filesystem::create_directories("build");
+		std::filesystem::remove(path);
+
+		bro::Database db;
+		db.open(bro.log, path);
+		db.put("a.o", bro::Database::Record{1, 2, {}});
+		db.close();
+
+		std::ofstream torn(path, std::ios::binary | std::ios::app);
+		torn.write("R\x01\x00", 3);
+		torn.close();
+
+		db.open(bro.log, path);
+		db.put("b.o", bro::Database::Record{3, 4, {}});
+		db.close();
+
+		bro::Database::Record a, b;
+		db.open(bro.log, path);
+		if(!db.get("a.o", a) || a.command != 1 || !db.get("b.o", b) || b.command != 3){
+			bro.log.error("Database lost records written after a torn entry");
+			return 1;
+		}
+		db.close();
+	}
+
+	{
+		bro.log.info("NO: {}", 10);
+
+		// A pool given only on the command of a link applies to its entry
+		bro.pool("link", 1);
+		std::size_t pooled_ix = bro.cmd("pooled", {"gcc", "${in}", "-o", "${out}"});
+		bro.cmds[pooled_ix].pool = "link";
+
+		std::size_t pbin_ix = bro.link("pbin", "${mod}");
+		bro.useCmd(pbin_ix, pooled_ix, ".o");
+		bro.applyMod(pbin_ix, mod_ix);
+
+		bool pooled = false;
+		for(const auto& node: bro.graph()->nodes)
+			pooled |= node.output == "build/pbin/mod" && node.pool == "link";
+		if(!pooled){
+			bro.log.error("Link entry ignored the pool of its command");
+			return 1;
+		}
+	}
+
+	{
+		bro.log.info("NO: {}", 11);
+
+		// Arguments that all drop out leave nothing to spawn
+		bro::Cmd empty({bro::String("")});
+		if(empty.sync(bro.log) == 0){
+			bro.log.error("Empty command succeeded");
+			return 1;
+		}
+	}
+
+	{
+		bro.log.info("NO: {}", 12);
+
+		// Headers of an entry without a depfile are unknown, so it cannot be cached
+		std::size_t nodep_ix = bro.transform("nodep", ".o");
+		bro.useCmd(nodep_ix, cxx_ix, ".cpp");
+		bro.applyMod(nodep_ix, mod_ix);
+
+		for(const auto& node: bro.graph()->nodes){
+			const std::string& out = node.output.str();
+			if((bro::starts_with(out, "build/obj/") && !node.cacheable) || (bro::starts_with(out, "build/nodep/") && node.cacheable)){
+				bro.log.error("Entry {} cacheable: {}", node.output, node.cacheable);
+				return 1;
+			}
+		}
+	}
+
 	if(!bro.isFlagSet("save")){
 		std::filesystem::remove_all("src");
 		std::filesystem::remove_all("common");
@@ -42,18 +42,56 @@
 
 #include <array>
 #include <vector>
+#include <memory>
+#include <deque>
+#include <queue>
+#include <chrono>
 #include <future>
 #include <limits>
+#include <cmath>
+#include <thread>
 #include <sstream>
 #include <fstream>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
 #include <iomanip>
 #include <iostream>
 #include <algorithm>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <shared_mutex>
+#include <condition_variable>
 #include <filesystem>
 #include <string_view>
 #include <unordered_set>
 #include <unordered_map>
 
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/mman.h>
+#endif
+
+extern char** environ;
+
 namespace bro{
 
 inline const std::string_view VERSION = "2.0";
@@ -111,102 +149,179 @@ inline const std::string_view C_COMPILER_NAME =
 			std::string{str}
 		{}
 
-		String escape() const {
-			const std::string needs = "\" \n\r";
-			if(find_first_of(needs) != std::string::npos){
-				std::stringstream ss;
-				ss << std::quoted(*this);
-				return ss.str();
-			}
+		String escape() const;
 
-			return *this;
-		}
+		std::vector<String> resolve(const std::unordered_map<std::string, std::vector<std::string>>& dict) const;
+
+		std::unordered_set<std::string> variables() const;
+	};
 
-		std::vector<String> resolve(const std::unordered_map<std::string, std::vector<std::string>> dict, std::string::size_type pos = 0) const {
-			if(pos >= size())
-				return {*this};
+	// Variables commands are expanded with. Scopes nest (global flags, stage,
+	// module, entry) and a lookup walks up through the parents, which are
+	// shared and never modified, instead of every entry copying them.
+	struct Scope{
+		std::shared_ptr<const Scope> parent;
+		std::unordered_map<std::string, std::vector<std::string>> vars;
+
+		Scope() = default;
+		Scope(std::unordered_map<std::string, std::vector<std::string>> vars, std::shared_ptr<const Scope> parent = nullptr):
+			parent{std::move(parent)},
+			vars{std::move(vars)}
+		{}
 
-			std::string::size_type dollar = find('$', pos);
-			if(dollar == std::string::npos)
-				return {*this};
+		// Values of the innermost definition of name, nullptr if there is none
+		const std::vector<std::string>* find(const std::string& name) const;
+	};
 
-			if(dollar + 1 >= size())
-				return {*this};
+	// A string parsed once into literal text and ${var} references, so it
+	// can be expanded any number of times in a single pass. $$ stands for $,
+	// a $ not followed by { is literal and unknown variables expand to
+	// nothing. A variable with several values multiplies the expansions.
+	struct StrTmpl{
+		struct Token{
+			std::string text; // Literal text or the name of the variable
+			bool var = false;
+		};
 
-			if(at(dollar + 1) == '$'){
-				String s = *this;
-				s.replace(dollar, 2, "$");
-				return s.resolve(dict, dollar + 2);
-			}
+		std::vector<Token> tokens;
 
-			if(at(dollar + 1) != '{')
-				return resolve(dict, dollar + 1);
+		StrTmpl() = default;
+		StrTmpl(std::string_view str);
 
-			std::string::size_type end = find('}', dollar);
-			if(end == std::string::npos)
-				return {*this};
+		inline bool uses(std::string_view var) const {
+			return std::any_of(tokens.begin(), tokens.end(), [&](const Token& t){ return t.var && t.text == var; });
+		}
+
+		// Appends every expansion to out, buf is scratch space the caller reuses
+		void expand(const Scope& scope, std::vector<String>& out, std::string& buf) const;
+
+		void _expand(const Scope& scope, std::size_t ix, std::vector<String>& out, std::string& buf) const;
+	};
+
+	// Hashes strings and whatever converts to std::string_view the same way,
+	// so FlatMap<std::string, T> can be searched without making a std::string
+	struct FlatHash{
+		inline std::size_t operator()(std::string_view key) const {
+			return std::hash<std::string_view>{}(key);
+		}
+
+		template<typename T>
+		inline typename std::enable_if<std::is_integral<T>::value, std::size_t>::type operator()(T key) const {
+			return static_cast<std::size_t>(static_cast<std::uint64_t>(key) * 0x9E3779B97F4A7C15ULL);
+		}
+	};
 
-			std::string var = substr(dollar + 2, end - dollar - 2);
-			const auto vals = dict.find(var);
-			if(vals == dict.end() || (*vals).second.size() == 0){
-				String s = *this;
-				s.replace(dollar, end - dollar + 1, "");
-				return s.resolve(dict, dollar);
+	// Open addressing hash map. Entries are kept densely in insertion order,
+	// the table holds entry indices only and is probed linearly. Lookups
+	// accept anything FlatHash hashes and K compares equal to. There is no
+	// erase, nothing in bro removes keys.
+	template<typename K, typename T, typename H = FlatHash>
+	struct FlatMap{
+		using value_type = std::pair<K, T>;
+		using iterator = typename std::vector<value_type>::iterator;
+		using const_iterator = typename std::vector<value_type>::const_iterator;
+
+		std::vector<value_type> entries;
+		std::vector<std::uint32_t> table; // Entry index + 1, 0 marks a free slot
+
+		inline iterator begin(){ return entries.begin(); }
+		inline iterator end(){ return entries.end(); }
+		inline const_iterator begin() const { return entries.begin(); }
+		inline const_iterator end() const { return entries.end(); }
+		inline std::size_t size() const { return entries.size(); }
+		inline bool empty() const { return entries.empty(); }
+
+		// Slot holding key or the free slot where it belongs
+		template<typename Q>
+		inline std::size_t _slot(const Q& key) const {
+			std::size_t mask = table.size() - 1;
+			for(std::size_t slot = H{}(key) & mask;; slot = (slot + 1) & mask){
+				std::uint32_t e = table[slot];
+				if(!e || entries[e - 1].first == key)
+					return slot;
 			}
+		}
 
-			std::vector<String> ret;
-			for(const auto& val: (*vals).second){
-				String s = *this;
-				s.replace(dollar, end - dollar + 1, val);
-				const auto& variants = s.resolve(dict, dollar + val.size() + 1);
-				ret.insert(ret.end(), variants.begin(), variants.end());
+		inline void _grow(){
+			table.assign(table.empty() ? 16 : table.size() * 2, 0);
+			std::size_t mask = table.size() - 1;
+			for(std::size_t i = 0; i < entries.size(); i++){
+				std::size_t slot = H{}(entries[i].first) & mask;
+				while(table[slot])
+					slot = (slot + 1) & mask;
+				table[slot] = static_cast<std::uint32_t>(i + 1);
 			}
+		}
 
-			return ret;
+		template<typename Q>
+		inline iterator find(const Q& key){
+			if(table.empty())
+				return end();
+
+			std::uint32_t e = table[_slot(key)];
+			return e ? entries.begin() + (e - 1) : end();
 		}
 
-		std::unordered_set<std::string> variables() const {
-			std::unordered_set<std::string> ret;
+		template<typename Q>
+		inline const_iterator find(const Q& key) const {
+			if(table.empty())
+				return end();
 
-			std::string::size_type pos = 0;
-			while((pos = find('$', pos)) != std::string::npos){
-				if(pos + 1 >= size() || at(pos + 1) != '{'){
-					pos += 2;
-					continue;
-				}
+			std::uint32_t e = table[_slot(key)];
+			return e ? entries.begin() + (e - 1) : end();
+		}
 
-				std::string::size_type end = find('}', pos);
-				if(end == std::string::npos)
-					return ret;
+		template<typename Q>
+		inline std::size_t count(const Q& key) const {
+			return find(key) != end();
+		}
 
-				ret.emplace(substr(pos + 2, end - pos - 2));
-				pos = end;
-			}
+		// Finds key or inserts it with T(args...), probing only once
+		template<typename Q, typename... Args>
+		inline std::pair<iterator, bool> try_emplace(const Q& key, Args&&... args){
+			// Keep the load factor at most 1/2
+			if((entries.size() + 1) * 2 > table.size())
+				_grow();
 
-			return ret;
+			std::size_t slot = _slot(key);
+			if(table[slot])
+				return {entries.begin() + (table[slot] - 1), false};
+
+			entries.emplace_back(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+			table[slot] = static_cast<std::uint32_t>(entries.size());
+			return {entries.end() - 1, true};
+		}
+
+		template<typename Q>
+		inline T& operator[](const Q& key){
+			return try_emplace(key).first->second;
 		}
 	};
 
 	template <typename K, typename V>
 	struct Dictionary: public std::vector<V>{
-		std::unordered_map<K, std::size_t> dict;
+		// Keys are looked up by std::string_view when they are strings
+		using Key = typename std::conditional<std::is_same<K, std::string>::value, std::string_view, const K&>::type;
 
-		inline V& operator[](const K& ix){
-			if(dict.find(ix) == dict.end()){
-				std::size_t i = std::vector<V>::size();
+		FlatMap<K, std::size_t> dict;
+
+		inline V& operator[](Key ix){
+			auto [it, added] = dict.try_emplace(ix, std::vector<V>::size());
+			if(added)
 				std::vector<V>::emplace_back();
-				dict[ix] = i;
-				return std::vector<V>::operator[](i);
-			}
 
-			return std::vector<V>::operator[](dict[ix]);
+			return std::vector<V>::operator[](it->second);
 		}
 
 		inline V& operator[](const std::size_t ix){
 			return std::vector<V>::operator[](ix);
 		}
 
-		inline bool alias(const K& ix1, std::size_t ix2){
+		inline const V& operator[](const std::size_t ix) const {
+			return std::vector<V>::operator[](ix);
+		}
+
+		inline bool alias(Key ix1, std::size_t ix2){
 			if(ix2 >= std::vector<V>::size())
 				return true;
 
@@ -215,36 +330,141 @@ inline const std::string_view C_COMPILER_NAME =
 			return false;
 		}
 
-		inline bool alias(const K& ix1, const K& ix2){
-			if(dict.find(ix2) == dict.end())
+		inline bool alias(Key ix1, Key ix2){
+			auto it = dict.find(ix2);
+			if(it == dict.end())
 				return true;
 
-			return alias(ix1, dict[ix2]);
+			return alias(ix1, it->second);
+		}
+
+		inline typename std::vector<V>::iterator find(Key ix){
+			auto it = dict.find(ix);
+			if(it == dict.end())
+				return std::vector<V>::end();
+
+			return std::vector<V>::begin() + it->second;
 		}
 
-		inline typename std::vector<V>::iterator find(const K& ix){
-			if(dict.find(ix) == dict.end())
+		inline typename std::vector<V>::const_iterator find(Key ix) const {
+			auto it = dict.find(ix);
+			if(it == dict.end())
 				return std::vector<V>::end();
 
-			return std::vector<V>::begin() + dict[ix];
+			return std::vector<V>::begin() + it->second;
 		}
 
 		template<typename... Args>
-		inline std::pair<std::size_t, V&> emplace(const K& ix, Args&&... args){
-			if(dict.find(ix) != dict.end()){
-				std::size_t i = dict[ix];
-				V& ref = (std::vector<V>::operator[](i) = V(std::forward<Args>(args)...));
-				return std::pair<std::size_t, V&>(i, ref);
+		inline std::pair<std::size_t, V&> emplace(Key ix, Args&&... args){
+			auto [it, added] = dict.try_emplace(ix, std::vector<V>::size());
+			if(!added){
+				V& ref = (std::vector<V>::operator[](it->second) = V(std::forward<Args>(args)...));
+				return std::pair<std::size_t, V&>(it->second, ref);
 			}
 
-			std::size_t i = std::vector<V>::size();
 			V& ref = std::vector<V>::emplace_back(std::forward<Args>(args)...);
-			dict[ix] = i;
-			return std::pair<std::size_t, V&>(i, ref);
+			return std::pair<std::size_t, V&>(it->second, ref);
+		}
+	};
+
+	// Streaming 64-bit xxHash (XXH64)
+	struct Hash{
+		static constexpr std::uint64_t P1 = 0x9E3779B185EBCA87ULL;
+		static constexpr std::uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+		static constexpr std::uint64_t P3 = 0x165667B19E3779F9ULL;
+		static constexpr std::uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+		static constexpr std::uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+		std::uint64_t v[4];
+		std::uint64_t seed;
+		std::uint64_t total = 0;
+		unsigned char buf[32];
+		std::size_t buffered = 0;
+
+		Hash(std::uint64_t seed = 0):
+			v{seed + P1 + P2, seed + P2, seed, seed - P1},
+			seed{seed}
+		{}
+
+		static inline std::uint64_t rotl(std::uint64_t x, int r){
+			return (x << r) | (x >> (64 - r));
+		}
+
+		static std::uint64_t read64(const unsigned char* p);
+
+		static std::uint32_t read32(const unsigned char* p);
+
+		static std::uint64_t round(std::uint64_t acc, std::uint64_t input);
+
+		static inline std::uint64_t merge(std::uint64_t acc, std::uint64_t val){
+			acc ^= round(0, val);
+			return acc * P1 + P4;
+		}
+
+		Hash& update(const void* data, std::size_t len);
+
+		Hash& update(std::string_view str);
+
+		inline Hash& update(std::uint64_t x){
+			return update(&x, sizeof(x));
+		}
+
+		std::uint64_t digest() const;
+
+		static inline std::uint64_t of(const void* data, std::size_t len){
+			return Hash{}.update(data, len).digest();
+		}
+
+		// Hash of the file contents, 0 if it cannot be read
+		static std::uint64_t file(const std::filesystem::path& p);
+	};
+
+	// Writes log lines and captured command output from a thread of its own,
+	// so messages of parallel jobs never interleave and nobody waits for the
+	// terminal. Messages are pushed onto a lock-free stack that the writer
+	// takes whole and reverses back into the order they were logged in.
+	struct LogWriter{
+		struct Message{
+			Message* next;
+			int fd;
+			std::string text;
+		};
+
+		std::atomic<Message*> head{nullptr};
+		std::atomic<bool> sleeping{false};
+		std::atomic<std::uint64_t> pushed{0};
+		std::uint64_t written = 0; // Guarded by mtx
+		std::mutex mtx;
+		std::condition_variable wake;
+		std::condition_variable drained;
+		std::thread thread;
+		bool stop = false;
+
+		LogWriter():
+			thread{[this](){ loop(); }}
+		{}
+
+		~LogWriter();
+
+		static inline LogWriter& instance(){
+			static LogWriter writer;
+			return writer;
 		}
+
+		void push(int fd, std::string text);
+
+		// Waits until everything pushed so far is written
+		void flush();
+
+		void loop();
+
+		static void _write(int fd, std::string_view text);
 	};
 
 	struct Log{
+		bool capture = true; // Collect the output of commands and print it in one piece once they finish
+		bool quiet = false; // Only warnings, errors and failed commands
+
 		inline void format(std::ostream& out, std::string_view fmt){
 			out << fmt;
 		}
@@ -264,11 +484,27 @@ inline const std::string_view C_COMPILER_NAME =
 			}
 		}
 
+		static inline std::ostringstream& _buffer(){
+			thread_local std::ostringstream ss;
+			ss.str({});
+			return ss;
+		}
+
 		template<typename... Args>
 		inline void log(std::string_view prefix, std::string_view fmt, Args... args){
-			std::cerr << prefix << ": ";
-			format(std::cerr, fmt, args...);
-			std::cerr << std::endl;
+			std::ostringstream& ss = _buffer();
+			ss << prefix << ": ";
+			format(ss, fmt, args...);
+			ss << '\n';
+			emit(STDERR_FILENO, ss.str());
+		}
+
+		inline void emit(int fd, std::string text){
+			LogWriter::instance().push(fd, std::move(text));
+		}
+
+		inline void flush(){
+			LogWriter::instance().flush();
 		}
 
 		template<typename... Args>
@@ -283,233 +519,425 @@ inline const std::string_view C_COMPILER_NAME =
 
 		template<typename... Args>
 		inline auto info(std::string_view fmt, Args&&... args) -> decltype(log<Args...>("INFO", fmt, std::forward<Args>(args)...)){
+			if(quiet)
+				return;
 			return log<Args...>("INFO", fmt, std::forward<Args>(args)...);
 		}
 
 		inline void cmd(std::string_view cmd){
-			log("CMD", "{}", cmd);
+			if(!quiet)
+				log("CMD", "{}", cmd);
 		}
 	};
 
-	struct File: public std::filesystem::path{
-		bool exists = false;
-		std::filesystem::file_time_type time;
+	// A path interned in a process wide arena: every distinct path is stored
+	// once and referred to by its 32-bit id, id 0 being the empty path.
+	// Interning and lookups are safe from any thread.
+	struct Path{
+		struct Arena{
+			std::shared_mutex mtx;
+			std::deque<std::string> strings{""}; // Never moved, ids index them
+			std::unordered_map<std::string_view, std::uint32_t> ids;
+		};
 
-		File() = default;
+		struct Hasher{
+			inline std::size_t operator()(const Path& p) const {
+				return p.id;
+			}
+		};
 
-		File(std::filesystem::path p):
-			std::filesystem::path{p}
-		{
-			exists = std::filesystem::exists(p);
+		std::uint32_t id = 0;
 
-			if(exists){
-				time = std::filesystem::last_write_time(p);
-			}
+		Path() = default;
+
+		Path(std::string_view p):
+			id{_intern(p)}
+		{}
+
+		Path(const std::string& p):
+			Path{std::string_view{p}}
+		{}
+
+		Path(const char* p):
+			Path{std::string_view{p}}
+		{}
+
+		Path(const std::filesystem::path& p):
+			Path{std::string_view{p.native()}}
+		{}
+
+		static Arena& _arena();
+
+		static std::uint32_t _intern(std::string_view p);
+
+		// Number of ids handed out so far, for tables indexed by id
+		static std::size_t count();
+
+		const std::string& str() const;
+
+		inline operator const std::string&() const {
+			return str();
 		}
 
-		constexpr const std::filesystem::path& path() const {
-			return *this;
+		inline const char* c_str() const {
+			return str().c_str();
 		}
 
-		inline bool operator>(const File& f) const {
-			return exists && f.exists && this->time > f.time;
+		inline bool empty() const {
+			return id == 0;
 		}
 
-		inline bool operator<(const File& f) const {
-			return exists && f.exists && this->time < f.time;
+		// Same as std::filesystem::path::extension(), points into the arena
+		std::string_view extension() const;
+
+		inline bool operator==(const Path& p) const {
+			return id == p.id;
 		}
 
-		inline int copy(Log& log, std::filesystem::path to) const {
-			if(!exists){
-				log.error("File does not exist {}", path());
-				return 1;
-			}
+		inline bool operator!=(const Path& p) const {
+			return id != p.id;
+		}
+	};
 
-			std::error_code ec;
-			std::filesystem::copy(*this, to, std::filesystem::copy_options::overwrite_existing, ec);
-			
-			if(ec){
-				log.error("Failed to copy from {} to {}: {}", path(), to, ec);
-				return ec.value();
-			}
+	// What a single stat call tells about a path
+	struct Stat{
+		bool exists = false;
+		bool directory = false;
+		std::int64_t mtime = 0; // Nanoseconds since the Unix epoch
+		std::uint64_t size = 0;
+		std::uint64_t ino = 0;
 
-			return 0;
+		static Stat of(const std::string& p);
+	};
+
+	// Stats every path at most once while it is active, shared by all
+	// threads. Bro::build() activates one for the duration of the build;
+	// whatever changes a path on disk has to invalidate() it.
+	struct StatCache{
+		std::unordered_map<std::string, Stat> stats;
+		mutable std::shared_mutex mtx;
+
+		static inline StatCache*& active(){
+			static StatCache* cache = nullptr;
+			return cache;
 		}
 
-		inline int move(Log& log, std::filesystem::path to){
-			if(!exists){
-				log.error("File does not exist {}", path());
-				return 1;
+		// Stat through the active cache, if any
+		static inline Stat stat(const std::string& p){
+			StatCache* cache = active();
+			return cache ? cache->get(p) : Stat::of(p);
+		}
+
+		static void invalidate(const std::string& p);
+
+		Stat get(const std::string& p);
+
+		// Activates a cache for the lifetime of the guard
+		struct Guard{
+			StatCache* prev;
+
+			Guard(StatCache& cache):
+				prev{active()}
+			{
+				active() = &cache;
 			}
 
-			std::error_code ec;
-			std::filesystem::rename(path(), to, ec);
-			
-			if(ec){
-				log.error("Failed to move from {} to {}: {}", path(), to, ec);
-				return ec.value();
+			~Guard(){
+				active() = prev;
 			}
+		};
+	};
+
+	struct File: public std::filesystem::path{
+		bool exists = false;
+		std::int64_t time = 0; // Modification time in nanoseconds since the Unix epoch
+		std::uint64_t size = 0;
+		std::uint64_t ino = 0;
+		mutable std::uint64_t _hash = 0;
+		mutable bool _hashed = false;
 
-			*this = to;
+		File() = default;
 
-			return 0;
+		File(std::filesystem::path p);
+
+		constexpr const std::filesystem::path& path() const {
+			return *this;
+		}
+
+		// Hash of the contents, computed on first use
+		std::uint64_t hash() const;
+
+		inline bool operator>(const File& f) const {
+			return exists && f.exists && this->time > f.time;
+		}
+
+		inline bool operator<(const File& f) const {
+			return exists && f.exists && this->time < f.time;
 		}
+
+		int copy(Log& log, std::filesystem::path to) const;
+
+		int move(Log& log, std::filesystem::path to);
 	};
 
 	struct Directory: public File{
 		Directory() = default;
 		Directory(std::filesystem::path p): File{p} {}
 
-		inline int copyTree(Log& log, std::filesystem::path p) const {
-			log.info("Copying tree {} => {}", path(), p);
+		int copyTree(Log& log, std::filesystem::path p) const;
 
-			if(!exists){
-				log.error("File does not exist {}", path());
-				return 1;
-			}
-			
-			std::error_code ec;
+		std::vector<File> files() const;
 
-			std::filesystem::create_directories(p, ec);
+		bool make(Log& log) const;
+	};
 
-			if(ec){
-				log.error("Failed to create directory {}: {}", p, ec);
-				return ec.value();
-			}
+	struct Runnable{
+		inline virtual int sync(Log& log) const = 0;
+		inline virtual std::future<int> async(Log& log) const = 0;
+		virtual ~Runnable() = default;
 
-			for(const auto& e: std::filesystem::recursive_directory_iterator(path())){
-				if(std::filesystem::is_directory(e.status())){
-					std::filesystem::path p2 = p / std::filesystem::relative(e.path(), path());
-					std::filesystem::create_directory(p2, ec);
+		// Starts the job and calls done with its status once it finishes.
+		// The default runs sync() on a thread of its own.
+		virtual void start(Log& log, std::function<void(int)> done) const;
 
-					if(ec){
-						log.error("Failed to create directory {}: {}", p2, ec);
-						return ec.value();
-					}
-				}
-			}
+		std::future<int> _async(Log& log) const;
+	};
 
-			return 0;
+	// How a process ended: its exit code or the signal that killed it
+	struct Exit{
+		int code = 0;
+		int signal = 0;
+		rusage usage{}; // Resources used by the process, zeroed when unknown
+
+		inline bool ok() const {
+			return code == 0 && signal == 0;
+		}
+
+		// Shell-like status: the exit code or 128 + signal number
+		inline int status() const {
+			return signal ? 128 + signal : code;
+		}
+
+		// Peak resident set size in bytes
+		inline std::uint64_t maxrss() const {
+			return static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
 		}
 
-		inline std::vector<File> files() const {
-			std::vector<File> files;
-			if(!exists)
-				return files;
+		static Exit from(int wstatus);
+	};
+
+	// Waits for all watched child processes on one thread and calls back
+	// (on that thread) as soon as one of them exits. On Linux every child
+	// gets a pidfd polled together with a wake-up pipe; where pidfds are
+	// not available a child falls back to a waiting thread of its own.
+	// Watched children run in process groups of their own, away from the
+	// terminal, so an interrupt of bro is passed on to them by the reaper.
+	struct Reaper{
+		using Callback = std::function<void(const Exit&)>;
+
+		struct Watch{
+			pid_t pid;
+			Callback done;
+		};
 
-			for(const auto& e: std::filesystem::recursive_directory_iterator(path())){
-				if(std::filesystem::is_regular_file(e.status())){
-					files.emplace_back(e.path());
+		std::mutex mtx;
+		std::unordered_map<int, Watch> watched; // pidfd => child
+		std::thread thread;
+		int wake[2] = {-1, -1};
+		bool stop = false;
+
+		static inline int wakefd = -1; // For _interrupt(), which cannot lock
+		static inline volatile std::sig_atomic_t interrupted = 0;
+
+		Reaper(){
+			// Callbacks log, the writer has to outlive the reaper
+			LogWriter::instance();
+
+			if(pipe(wake) == 0){
+				wakefd = wake[1];
+				thread = std::thread([this](){ loop(); });
+
+				for(int sig: {SIGINT, SIGTERM, SIGHUP}){
+					struct sigaction old{};
+					if(sigaction(sig, nullptr, &old) || old.sa_handler != SIG_DFL)
+						continue;
+
+					struct sigaction act{};
+					act.sa_handler = _interrupt;
+					act.sa_flags = SA_RESTART;
+					sigemptyset(&act.sa_mask);
+					sigaction(sig, &act, nullptr);
 				}
 			}
+		}
 
-			return files;
+		~Reaper();
+
+		static inline Reaper& instance(){
+			static Reaper reaper;
+			return reaper;
 		}
 
-		inline bool make(Log& log) const {
-			if(exists)
-				return false;
+		static Exit reap(pid_t pid);
 
-			log.info("Making directory: {}", path());
-			std::filesystem::create_directories(path());
-			return true;
+		void watch(pid_t pid, Callback done);
+
+		// Sends sig to the process group of every watched child, they are
+		// reaped as usual. Children waited for by a thread of their own (no
+		// pidfd) are not reached.
+		void terminate(int sig = SIGTERM);
+
+		// Signal handler, the reaper terminates the children and dies of sig
+		static void _interrupt(int sig);
+
+		inline void notify(){
+			char c = 0;
+			while(write(wake[1], &c, 1) < 0 && errno == EINTR);
 		}
+
+		void loop();
 	};
 
-	struct Runnable{
-		inline virtual int sync(Log& log) const = 0;
-		inline virtual std::future<int> async(Log& log) const = 0;
-		virtual ~Runnable() = default;
+	// Fixed number of threads running posted tasks in order, so work that
+	// comes per command does not need a thread per command. The threads are
+	// started by the first task and joined on destruction.
+	struct Workers{
+		std::size_t size;
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::condition_variable idle;
+		std::deque<std::function<void()>> tasks;
+		std::vector<std::thread> threads;
+		std::size_t busy = 0;
+		bool stop = false;
+
+		Workers(std::size_t size):
+			size{std::max<std::size_t>(size, 1)}
+		{
+			// Tasks log, the writer has to outlive the workers
+			LogWriter::instance();
+		}
+
+		~Workers();
+
+		// Checks before and bookkeeping after every command of a build,
+		// one thread per CPU we may run on
+		static Workers& instance();
+
+		void post(std::function<void()> task);
+
+		// Until every task posted so far ran
+		void wait();
+
+		void loop();
 	};
 
 	struct Cmd: public Runnable{
 		std::vector<String> cmd;
+		bool shell = false; // Run through /bin/sh -c instead of executing cmd[0] directly
 		
 		Cmd() = default;
 
-		Cmd(const std::vector<String>& cmd):
-			cmd{cmd}
+		Cmd(const std::vector<String>& cmd, bool shell = false):
+			cmd{cmd},
+			shell{shell}
 		{}
 
 		template<std::size_t N>
-		Cmd(const std::array<String, N>& cmd):
-			cmd{cmd.begin(), cmd.end()}
+		Cmd(const std::array<String, N>& cmd, bool shell = false):
+			cmd{cmd.begin(), cmd.end()},
+			shell{shell}
 		{}
 
-		inline String str() const {
-			std::stringstream ss;
-			for(const auto& e: cmd)
-				ss << " " << e.escape();
+		String str() const;
 
-			return ss.str().substr(1);
-		}
+		std::uint64_t hash() const;
+
+		// Empty arguments (e.g. from variables without values) are dropped,
+		// just like the shell did when the command was run through system().
+		std::vector<std::string> argv() const;
+
+		// Executable argv() runs, looked up in PATH as posix_spawnp() does,
+		// empty when not found
+		std::string program() const;
+
+		// out (if not -1) becomes the stdout and stderr of the child, group
+		// puts it into a process group of its own
+		int spawn(Log& log, pid_t& pid, int out = -1, bool group = false) const;
+
+		// Unnamed temporary file for the output of a command, -1 on failure
+		static int _capture();
+
+		// Prints the captured output (all of it at once, in quiet mode only
+		// when the command failed) and closes out
+		static void _report(Log& log, int out, const Exit& e, const std::string& line);
+
+		Exit exec(Log& log) const;
 
 		inline int sync(Log& log) const override {
-			if(cmd.size() == 0){
-				log.error("Cannot run empty CMD...");
-				return -1;
-			}
+			return exec(log).status();
+		}
+
+		// start() reporting how the process ended and what it used
+		void launch(Log& log, std::function<void(const Exit&)> done) const;
 
-			std::string line = str();
-			log.cmd(line);
-			return system(line.c_str());
+		inline void start(Log& log, std::function<void(int)> done) const override {
+			launch(log, [done](const Exit& e){
+				done(e.status());
+			});
 		}
 
 		inline std::future<int> async(Log& log) const override {
-			if(cmd.size() == 0){
-				log.error("Cannot run empty CMD...");
-				return std::async([](){ return -1; });
-			}
-			
-			std::string line = str();
-			log.cmd(line);
-			return std::async([](std::string line){
-				return system(line.c_str()); 
-			}, line);
+			return _async(log);
 		}
 	};
 
 	struct CmdTmpl{
 		std::string name;
 		std::vector<String> cmd;
+		bool shell = false;
+		bool restat = false; // See CmdEntry::restat
+		std::string pool; // See CmdEntry::pool
+		std::shared_ptr<const std::vector<StrTmpl>> program; // cmd parsed once, shared by all copies
 
 		CmdTmpl() = default;
 		
-		CmdTmpl(std::string_view name, const std::vector<String>& cmd):
+		CmdTmpl(std::string_view name, const std::vector<String>& cmd, bool shell = false):
 			name{name},
-			cmd{cmd}
+			cmd{cmd},
+			shell{shell},
+			program{_parse(this->cmd)}
 		{}
 
 		template<std::size_t N>
-		CmdTmpl(std::string_view name, const std::array<String, N>& cmd):
+		CmdTmpl(std::string_view name, const std::array<String, N>& cmd, bool shell = false):
 			name{name},
-			cmd{cmd.begin(), cmd.end()}
+			cmd{cmd.begin(), cmd.end()},
+			shell{shell},
+			program{_parse(this->cmd)}
 		{}
 
-		inline std::unordered_set<std::string> variables() const {
-			std::unordered_set<std::string> ret;
+		static std::shared_ptr<const std::vector<StrTmpl>> _parse(const std::vector<String>& cmd);
 
-			for(const auto& e: cmd)
-				ret.merge(e.variables());
-			
-			return ret;
-		}
+		std::unordered_set<std::string> variables() const;
 
-		inline std::vector<String> resolve(const std::unordered_map<std::string, std::vector<std::string>> dict) const {
-			std::vector<String> ret;
-			for(const auto& e: cmd){
-				const auto& resolved = e.resolve(dict);
-				ret.insert(ret.end(), resolved.begin(), resolved.end());
-			}
-			return ret;
-		}
+		bool uses(std::string_view var) const;
+
+		// Appends the expanded arguments to argv
+		void resolve(const Scope& scope, std::vector<String>& argv) const;
+
+		std::vector<String> resolve(const Scope& scope) const;
 
 		inline Cmd compile() const {
-			return Cmd(resolve({}));
+			return Cmd(resolve(Scope{}), shell);
+		}
+
+		inline Cmd compile(const Scope& scope) const {
+			return Cmd(resolve(scope), shell);
 		}
 
 		inline Cmd compile(const std::unordered_map<std::string, std::vector<std::string>>& vars) const {
-			return Cmd(resolve(vars));
+			return compile(Scope{vars});
 		}
 
 		inline int sync(Log& log) const {
@@ -529,205 +957,598 @@ inline const std::string_view C_COMPILER_NAME =
 		}
 	};
 
-	struct CmdPoolAsync: public std::vector<std::future<int>> {
-		inline int wait(){
-			int ret = 0;
-			for(auto& cmd: *this){
-				ret += cmd.get();
-			}
-			return ret;
+	// GNU make jobserver: a pipe (or a named fifo) holding a byte for every
+	// free job slot besides the one each process implicitly has. A job beyond
+	// the first one takes a byte and writes it back once it is done, so all
+	// the builds nested in each other share a single budget.
+	struct Jobserver{
+		int rfd = -1; // Non-blocking read end of our own
+		int wfd = -1;
+		int served[2] = {-1, -1}; // Pipe served to children by serve()
+		std::string makeflags; // MAKEFLAGS before serve() changed it
+		bool hadMakeflags = false;
+
+		Jobserver() = default;
+		Jobserver(const Jobserver&) = delete;
+		Jobserver& operator=(const Jobserver&) = delete;
+
+		~Jobserver();
+
+		inline bool enabled() const {
+			return rfd >= 0;
 		}
-	};
 
-	struct CmdPool: public std::vector<std::unique_ptr<Runnable>> {
-		inline int sync(Log& log) const {
-			int ret = 0;
-			for(auto& cmd: *this){
-				ret = cmd->sync(log);
-				if(ret) return ret;
-			}
-			return 0;
+		inline bool serving() const {
+			return served[0] >= 0;
 		}
 
-		inline CmdPoolAsync async(Log& log) const {
-			CmdPoolAsync pool;
-			for(const auto& cmd: *this){
-				pool.emplace_back(cmd->async(log));
-			}
-			return pool;
-		}
+		// Joins the jobserver advertised by MAKEFLAGS, either
+		// --jobserver-auth=fifo:PATH or --jobserver-auth=R,W (--jobserver-fds
+		// of older makes). Returns true when there is none to join.
+		bool connect(Log& log, std::string_view flags);
 
-		template<typename T>
-		inline void push(const T& obj){
-			std::vector<std::unique_ptr<Runnable>>::push_back(std::make_unique<T>(obj));
-		}
-	};
+		// Serves jobs - 1 tokens and advertises them to children in MAKEFLAGS
+		bool serve(Log& log, std::size_t jobs);
 
-	struct CmdQueue: public std::vector<std::unique_ptr<Runnable>>, public Runnable {
-		inline int sync(Log& log) const override {
-			int ret = 0;
-			for(auto& cmd: *this){
-				ret = cmd->sync(log);
-				if(ret) return ret;
-			}
-			return 0;
-		}
+		// Opens a non-blocking description of the pipe behind fd, so that
+		// reads never block without changing the flags others share
+		static int _reopen(int fd);
 
-		inline std::future<int> async(Log& log) const override {
-			return std::async([](Log* log, const CmdQueue* q){
-				return q->sync(*log);
-			}, &log, this);
-		}
+		bool take(char& token) const;
 
-		template<typename T>
-		inline void push(const T& obj){
-			std::vector<std::unique_ptr<Runnable>>::push_back(std::make_unique<T>(obj));
-		}
+		void give(char token) const;
+
+		// Waits until a token may be available or wake is readable, true when
+		// the jobserver is gone
+		bool wait(int wake) const;
 	};
 
-	struct CmdEntry: public Runnable{
-		CmdTmpl cmd;
-		std::string output;
-		std::vector<std::string> inputs;
-		std::vector<std::string> dependences;
-		std::unordered_map<std::string, std::vector<std::string>> flags;
-		bool smart;
-		
-		CmdEntry() = default;
+	// Limits of the cgroup we run in, the tightest one of it and its
+	// ancestors. cgroup v2 is read first, v1 controllers where it has none.
+	struct Cgroup{
+		// CPUs the quota allows, 0 when unlimited
+		static double cpus();
 
-		CmdEntry(std::string_view output, const std::vector<std::string>& inputs, const CmdTmpl& cmd, std::unordered_map<std::string, std::vector<std::string>> flags = {}, bool smart = false):
-			cmd{cmd},
+		// Memory limit in bytes, 0 when unlimited
+		static std::uint64_t memory();
+
+		// Our cgroup of the controller ("" for the unified hierarchy) and its
+		// ancestors, the ones visible under /sys/fs/cgroup
+		static std::vector<std::filesystem::path> _dirs(std::string_view controller);
+
+		static std::string _read(const std::filesystem::path& p);
+	};
+
+	// Runs jobs with at most `jobs` of them in flight at once. Each finished
+	// job hands its slot to the ready job with the highest priority (the
+	// lowest index among equal ones). A job becomes ready once every job
+	// listing it among its consumers has succeeded.
+	// Jobs report completion through a callback, so waiting for them does
+	// not take a thread per job.
+	// After keepGoing failures (0 = never) nothing new is started and the
+	// running child processes are terminated.
+	// With a jobserver every job but the first running one needs a token.
+	// Jobs may belong to a pool limiting how many of them run at once and
+	// may count against a budget for their expected peak memory; a job that
+	// does not fit waits for others to finish (and runs alone at worst).
+	// With load set, no more jobs start than the load average leaves room
+	// for below it (like make -l), but at least one.
+	struct Scheduler{
+		// What a job needs besides a slot
+		struct Need{
+			std::size_t pool = 0; // 1 + index of its pool in pools, 0 for none
+			std::uint64_t memory = 0; // Expected peak RSS in bytes
+		};
+
+		std::size_t jobs;
+		std::size_t keepGoing;
+		const Jobserver* jobserver = nullptr;
+		FlatMap<std::string, std::size_t> pools; // Name => depth, 0 is unlimited
+		std::uint64_t memory = 0; // Budget for the running jobs, 0 is unlimited
+		double load = 0; // 0 is unlimited
+
+		Scheduler(std::size_t jobs = 0, std::size_t keepGoing = 1):
+			jobs{jobs ? jobs : defaultJobs()},
+			keepGoing{keepGoing}
+		{}
+
+		// CPUs we may run on: online ones, our affinity mask and the cgroup
+		// quota, whichever is the lowest
+		static std::size_t defaultJobs();
+
+		using Start = std::function<void(std::size_t, std::function<void(int)>)>;
+
+		int run(Log& log, std::size_t count, const Start& start, const std::vector<std::vector<std::size_t>>& consumers = {}, const std::vector<std::uint64_t>& priority = {}, const std::vector<Need>& needs = {}) const;
+
+		int run(Log& log, const std::vector<std::unique_ptr<Runnable>>& cmds) const;
+	};
+
+	struct CmdPoolAsync: public std::vector<std::future<int>> {
+		int wait();
+	};
+
+	struct CmdPool: public std::vector<std::unique_ptr<Runnable>> {
+		int sync(Log& log) const;
+
+		CmdPoolAsync async(Log& log) const;
+
+		inline int run(Log& log, std::size_t jobs = 0) const {
+			return Scheduler{jobs}.run(log, *this);
+		}
+
+		template<typename T>
+		inline void push(const T& obj){
+			std::vector<std::unique_ptr<Runnable>>::push_back(std::make_unique<T>(obj));
+		}
+	};
+
+	struct CmdQueue: public std::vector<std::unique_ptr<Runnable>>, public Runnable {
+		int sync(Log& log) const override;
+
+		inline void start(Log& log, std::function<void(int)> done) const override {
+			_next(log, 0, std::move(done));
+		}
+
+		void _next(Log& log, std::size_t ix, std::function<void(int)> done) const;
+
+		inline std::future<int> async(Log& log) const override {
+			return _async(log);
+		}
+
+		template<typename T>
+		inline void push(const T& obj){
+			std::vector<std::unique_ptr<Runnable>>::push_back(std::make_unique<T>(obj));
+		}
+	};
+
+	// Persistent record of how every output was built, kept in the build
+	// directory. The file is an append-only log, the last record of an
+	// output wins; it is rewritten when stale records start to dominate.
+	// Paths are written once and referenced by 32-bit ids afterwards.
+	struct Database{
+		static constexpr char MAGIC[4] = {'B', 'R', 'O', 'D'};
+		static constexpr std::uint32_t VERSION = 6;
+		static constexpr char PATH = 'P';
+		static constexpr char RECORD = 'R';
+		static constexpr char HASH = 'H';
+		static constexpr char USAGE = 'U';
+
+		struct Record{
+			std::uint64_t command = 0; // Hash of the fully resolved command
+			std::uint64_t inputs = 0;  // Hash of the input state the command saw
+			std::vector<Path> deps; // Dependencies discovered by the command (depfile)
+			std::uint64_t output = 0;  // Content hash of the output (restat only)
+			std::int64_t mtime = 0;    // Output mtime after the command (restat only)
+		};
+
+		// Content hash of a file, valid while inode, size and mtime are unchanged
+		struct FileHash{
+			std::uint64_t ino = 0;
+			std::uint64_t size = 0;
+			std::int64_t mtime = 0;
+			std::uint64_t hash = 0;
+
+			inline bool same(const FileHash& f) const {
+				return ino == f.ino && size == f.size && mtime == f.mtime;
+			}
+		};
+
+		// What the last run of the command producing a file took
+		struct Usage{
+			std::uint64_t ms = 0; // Wall time, 0 if unknown
+			std::uint64_t rss = 0; // Peak resident set size in bytes
+		};
+
+		std::filesystem::path path;
+		bool content = false; // Compare inputs by content hash instead of mtime
+		std::unordered_map<Path, Record, Path::Hasher> records;
+		std::unordered_map<Path, FileHash, Path::Hasher> hashes;
+		std::unordered_map<Path, Usage, Path::Hasher> usages;
+		std::unordered_map<Path, std::uint32_t, Path::Hasher> ids; // Paths already written to out
+		std::size_t stale = 0;
+		std::ofstream out;
+		mutable std::mutex mtx;
+
+		Database() = default;
+		Database(const Database&) = delete;
+		Database& operator=(const Database&) = delete;
+
+		~Database(){
+			close();
+		}
+
+		template<typename T>
+		static inline bool _read(std::istream& in, T& val){
+			return static_cast<bool>(in.read(reinterpret_cast<char*>(&val), sizeof(val)));
+		}
+
+		template<typename T>
+		static inline void _write(std::ostream& out, const T& val){
+			out.write(reinterpret_cast<const char*>(&val), sizeof(val));
+		}
+
+		static inline void _header(std::ostream& out){
+			out.write(MAGIC, sizeof(MAGIC));
+			_write(out, VERSION);
+		}
+
+		static std::uint32_t _id(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path p);
+
+		static void _write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path output, const Record& rec);
+
+		static void _write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path file, const FileHash& fh);
+
+		static void _write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path output, const Usage& usage);
+
+		// Reads the file, end is set past the last entry read completely
+		bool _load(std::uint64_t& end);
+
+		bool open(Log& log, const std::filesystem::path& p);
+
+		void close();
+
+		bool get(Path output, Record& rec) const;
+
+		void put(Path output, const Record& rec);
+
+		Usage usage(Path output) const;
+
+		void putUsage(Path output, const Usage& usage);
+
+		// Content hash of a file, reusing the recorded one while the file
+		// keeps its inode, size and mtime
+		std::uint64_t contentHash(Path file);
+
+		// Hash of the paths, existence and modification times (or contents)
+		// of files
+		std::uint64_t state(std::initializer_list<const std::vector<Path>*> lists);
+
+		// Dependencies listed by a Makefile-style depfile (gcc -MMD -MF)
+		static std::vector<Path> parseDepfile(const std::filesystem::path& p);
+	};
+
+	// Minimal blocking HTTP/1.1 client and server helpers, one request per
+	// connection. Bodies are streamed in chunks and never held in memory.
+	struct Http{
+		static constexpr std::size_t CHUNK = 1 << 16;
+
+		struct Url{
+			std::string host;
+			std::string port = "80";
+			std::string prefix;
+
+			// Parses http://host[:port][/prefix], returns true on error
+			bool parse(std::string_view url);
+		};
+
+		struct Head{
+			std::string method;
+			std::string target;
+			int status = 0;
+			std::uint64_t length = 0;
+			bool sized = false; // Content-Length was given
+			bool chunked = false; // Transfer-Encoding: chunked, not supported
+			std::string rest; // Body bytes read together with the head
+		};
+
+		static int connect(const Url& url);
+
+		static bool send(int fd, const char* data, std::size_t len);
+
+		static inline bool send(int fd, std::string_view str){
+			return send(fd, str.data(), str.size());
+		}
+
+		static bool sendFile(int fd, const std::filesystem::path& p);
+
+		// Reads up to the end of the head, parses request or status line,
+		// Content-Length and Transfer-Encoding
+		static bool readHead(int fd, Head& head);
+
+		// Streams exactly head.length body bytes into sink
+		static bool readBody(int fd, const Head& head, const std::function<bool(const char*, std::size_t)>& sink);
+
+		// GET into a file, returns true only on 200 with the complete body,
+		// which needs a Content-Length to be known complete
+		static bool get(const Url& url, const std::string& path, const std::filesystem::path& file);
+
+		static bool put(const Url& url, const std::string& path, const std::filesystem::path& file);
+
+		static inline bool respond(int fd, int status, std::string_view reason, std::uint64_t length = 0){
+			return send(fd, "HTTP/1.1 " + std::to_string(status) + " " + std::string{reason} + "\r\nContent-Length: " + std::to_string(length) + "\r\nConnection: close\r\n\r\n");
+		}
+	};
+
+	// Content-addressed store of command outputs shared by all builds using
+	// the same directory. A manifest, keyed by the resolved command, the
+	// program it runs and the contents of inputs and dependences, lists the
+	// dependencies the command discovered; the output is keyed by the
+	// manifest key and their contents.
+	// Least recently used entries are evicted to keep within the budget.
+	struct Cache{
+		std::filesystem::path dir;
+		std::uint64_t budget = 0; // Bytes, 0 means unlimited
+		Http::Url remote; // Shared cache speaking the CacheServer protocol
+		mutable Workers uploads{8}; // One connection to the remote each
+
+		inline bool local() const {
+			return !dir.empty();
+		}
+
+		inline bool hasRemote() const {
+			return !remote.host.empty();
+		}
+
+		inline bool enabled() const {
+			return local() || hasRemote();
+		}
+
+		static std::string hex(std::uint64_t key);
+
+		inline std::filesystem::path _path(char kind, std::uint64_t key) const {
+			std::string h = hex(key);
+			return dir / std::string(1, kind) / h.substr(0, 2) / h;
+		}
+
+		static std::uint64_t _contents(Hash& h, Database& db, const std::vector<Path>& files);
+
+		std::uint64_t key(std::uint64_t command, Database& db, const std::vector<Path>& inputs, const std::vector<Path>& dependences) const;
+
+		std::uint64_t _object(std::uint64_t key, Database& db, const std::vector<Path>& deps) const;
+
+		// Copy-on-write clone where the filesystem supports it, otherwise a
+		// hard link, otherwise a plain copy
+		static bool _clone(const std::filesystem::path& from, const std::filesystem::path& to);
+
+		// Writes through a temporary file, so readers never see a partial entry
+		static bool _put(const std::filesystem::path& p, const std::function<bool(const std::filesystem::path&)>& write);
+
+		static inline void _touch(const std::filesystem::path& p){
+			utimensat(AT_FDCWD, p.c_str(), nullptr, 0);
+		}
+
+		static bool _readManifest(const std::filesystem::path& p, std::vector<Path>& deps);
+
+		// Restores output (and the dependencies it was built with) on a hit
+		bool restore(std::uint64_t key, const std::string& output, std::vector<Path>& deps, Database& db) const;
+
+		static bool _writeManifest(const std::filesystem::path& p, const std::vector<Path>& deps);
+
+		// Downloads manifest and object from the remote cache, streaming both
+		// to disk (into the local cache when there is one), and restores output
+		bool fetch(std::uint64_t key, const std::string& output, std::vector<Path>& deps, Database& db) const;
+
+		// Uploads are queued for the upload workers and run in the background
+		// until wait()
+		void _upload(std::uint64_t key, std::uint64_t object, const std::filesystem::path& file, const std::vector<Path>& deps) const;
+
+		void wait() const;
+
+		void store(std::uint64_t key, const std::string& output, const std::vector<Path>& deps, Database& db) const;
+
+		// Evicts least recently used entries until the cache fits the budget
+		void trim(Log& log) const;
+	};
+
+	// Reference server for the remote cache protocol: GET and PUT of
+	// /ac/<key> (manifests) and /cas/<key> (outputs), stored as files below
+	// dir. Every connection is served on a thread of its own.
+	struct CacheServer{
+		std::filesystem::path dir;
+		std::string host = "127.0.0.1";
+		std::string port = "8080";
+
+		static inline bool _valid(std::string_view key){
+			return key.size() == 16 && key.find_first_not_of("0123456789abcdef") == std::string_view::npos;
+		}
+
+		void _handle(int fd) const;
+
+		int serve(Log& log) const;
+	};
+
+	struct CmdEntry: public Runnable{
+		CmdTmpl cmd;
+		Path output;
+		std::vector<Path> inputs;
+		std::vector<Path> dependences;
+		std::shared_ptr<const Scope> scope; // Variables of the stage and module, ${in}, ${out} and ${depfile} are added on top
+		std::string depfile; // Dependencies written by the command, -MMD -MF ${depfile} is added if the template does not use it
+		bool restat = false; // Keep the previous output mtime when the command leaves the contents unchanged
+		bool cacheable = false; // The output may be restored from and stored in the cache, needs a depfile to know all it depends on
+		std::string pool; // Limits how many commands of it run at once, see Bro::pool()
+		bool smart = false;
+		Database* db = nullptr; // Consulted by smartRun() when set
+		const Cache* cache = nullptr; // Used for cacheable entries when a database is set
+		
+		CmdEntry() = default;
+
+		CmdEntry(Path output, const std::vector<Path>& inputs, const CmdTmpl& cmd, std::shared_ptr<const Scope> scope = nullptr, bool smart = false):
+			cmd{cmd},
 			output{output},
 			inputs{inputs},
-			flags{flags},
+			scope{std::move(scope)},
+			pool{cmd.pool},
 			smart{smart}
 		{}
 
 		template<std::size_t N, std::size_t M>
-		CmdEntry(std::string_view output, const std::array<std::string, N>& inputs, const CmdTmpl& cmd, std::unordered_map<std::string, std::vector<std::string>> flags = {}, bool smart = false):
+		CmdEntry(Path output, const std::array<std::string, N>& inputs, const CmdTmpl& cmd, std::shared_ptr<const Scope> scope = nullptr, bool smart = false):
 			cmd{cmd},
 			output{output},
 			inputs{inputs.begin(), inputs.end()},
-			flags{flags},
+			scope{std::move(scope)},
+			pool{cmd.pool},
 			smart{smart}
 		{}
 
 		inline Directory directory() const {
-			return Directory{output.substr(0, output.rfind('/'))};
+			const std::string& out = output.str();
+			return Directory{out.substr(0, out.rfind('/'))};
 		}
 
-		inline bool smartRun() const {
-			if(smart){
-				File o(output);
-				if(!o.exists)
-					return true;
-				
-				bool run = false;
-				for(const auto& i: inputs){
-					File f(i);
-					if(f > o){
-						run = true;
-						break;
-					}
-				}
+		Cmd compile() const;
 
-				if(!run) for(const auto& d: dependences){
-					File f(d);
-					if(f > o){
-						run = true;
-						break;
-					}
-				}
+		// State of the inputs and dependences, discovered dependencies are
+		// added by _finish() once the command has reported them
+		inline Database::Record record(const Cmd& c) const {
+			return Database::Record{c.hash(), db ? db->state({&inputs, &dependences}) : 0, {}};
+		}
 
-				return run;
-			}
+		inline std::uint64_t _state(std::uint64_t inputs, const std::vector<Path>& deps) const {
+			return Hash{}.update(inputs).update(db ? db->state({&deps}) : 0).digest();
+		}
 
-			return true;
+		// Early cutoff: an output rewritten with identical contents gets its
+		// previous mtime back, so entries depending on it stay up to date
+		void _restat(Database::Record& rec) const;
+
+		// Manifest key of the entry in the cache, 0 when it is not cached.
+		// Headers outside the depfile (system ones) are only covered through
+		// the contents of the compiler binary.
+		std::uint64_t _cacheKey(const Cmd& c, const Database::Record& rec) const;
+
+		// Outputs are unlinked before running, so a command writing in place
+		// cannot change a file hard linked into the cache
+		inline void _unlink() const {
+			std::error_code ec;
+			std::filesystem::remove(output.str(), ec);
 		}
 
-		inline int sync(Log& log) const override {
-			directory().make(log);
-			
-			if(!smartRun())
-				return 0;
+		bool _restore(Log& log, std::uint64_t key, const Database::Record& rec, bool remote = false) const;
 
-			std::unordered_map<std::string, std::vector<std::string>> vars({
-				{"in", inputs},
-				{"out", {output}}
-			});
+		void _finish(Database::Record rec, std::uint64_t key = 0, const std::vector<Path>* cached = nullptr) const;
 
-			vars.merge(std::unordered_map<std::string, std::vector<std::string>>(flags));
-			
-			return cmd.sync(log, vars);
+		// Records how long the command took and its peak memory, for
+		// scheduling the next build
+		inline void _usage(std::chrono::steady_clock::time_point start, const Exit& e, std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()) const {
+			if(!db)
+				return;
+
+			auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+			db->putUsage(output, Database::Usage{static_cast<std::uint64_t>(std::max<decltype(ms)>(ms, 1)), e.maxrss()});
 		}
 
-		inline std::future<int> async(Log& log) const override {
-			directory().make(log);
+		// With a database the output is rebuilt when the resolved command or
+		// the state of any input differs from the recorded one, otherwise
+		// when any input or dependence is newer than the output.
+		bool smartRun(const Database::Record& rec) const;
+
+		inline bool smartRun() const {
+			return smartRun(record(compile()));
+		}
+
+		int sync(Log& log) const override;
 
-			if(!smartRun())
-				return std::async(std::launch::async, []{ return 0; });
+		// start() reporting how the command ended, e is null when nothing had
+		// to run (up to date or restored from the cache). step (if set) is
+		// called as the command is spawned and as it exits, splitting the
+		// checks before it from the recording of its outputs after it.
+		void launch(Log& log, std::function<void(const Exit* e)> done, std::function<void()> step = nullptr) const;
 
-			std::unordered_map<std::string, std::vector<std::string>> vars({
-				{"in", inputs},
-				{"out", {output}}
+		inline void start(Log& log, std::function<void(int)> done) const override {
+			launch(log, [done](const Exit* e){
+				done(e ? e->status() : 0);
 			});
+		}
 
-			vars.merge(std::unordered_map<std::string, std::vector<std::string>>(flags));
-			
-			return cmd.async(log, vars);
+		inline std::future<int> async(Log& log) const override {
+			return _async(log);
 		}
 
-		inline std::string ninja() const {
-			std::stringstream ss;
-			ss << "build " << output << ": " << cmd.name;
+		std::string ninja() const;
 
-			for(const auto& in: inputs)
-				ss << " " << in;
+		std::string make() const;
+	};
 
-			if(dependences.size() > 0){
-				ss << " |";
-				for(const auto& dep: dependences)
-					ss << " " << dep;
-			}
+	// Chrome trace event format (chrome://tracing, ui.perfetto.dev) of a
+	// build. Every event is a complete ("X") one; tid is the slot a command
+	// ran in, bro's own phases are on tid 0.
+	struct Trace{
+		using Clock = std::chrono::steady_clock;
+
+		struct Event{
+			std::string name;
+			std::string cat;
+			std::int64_t ts; // Microseconds since epoch
+			std::int64_t dur;
+			std::size_t tid;
+			std::string args; // Members of the args object, already JSON
+		};
+
+		// Adds an event lasting from its construction to its destruction
+		struct Span{
+			Trace& trace;
+			std::string name;
+			std::int64_t ts;
 
-			for(const auto& [name, values]: flags){
-				ss << std::endl << "    " << name << " =";
-				for(const auto& value: values)
-					ss << " " << value;
+			Span(Trace& trace, std::string_view name):
+				trace{trace},
+				name{name},
+				ts{trace.now()}
+			{}
+
+			~Span(){
+				trace.add(name, "bro", ts, 0);
 			}
-			
-			return ss.str();
+		};
+
+		bool enabled = false;
+		Clock::time_point epoch = Clock::now();
+		std::mutex mtx;
+		std::vector<Event> events;
+
+		inline std::int64_t now() const {
+			return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - epoch).count();
 		}
 
-		inline std::string make() const {
-			std::stringstream ss;
-			ss << output << ":";
+		// Event from ts until end (now if negative), ignored unless enabled
+		void add(std::string_view name, std::string_view cat, std::int64_t ts, std::size_t tid, std::string args = {}, std::int64_t end = -1);
 
-			for(const auto& in: inputs)
-				ss << " " << in;
+		bool write(Log& log, const std::filesystem::path& p);
 
-			for(const auto& dep: dependences)
-				ss << " " << dep;
+		static std::string _escape(std::string_view str);
+	};
 
-			ss << std::endl << "\t";
+	// Every CmdEntry is a node, edges go from the entry producing a file to
+	// all entries consuming it as an input or a dependence.
+	struct Graph{
+		std::vector<CmdEntry> nodes;
+		std::vector<std::size_t> modules; // Module of every node
+		std::vector<std::size_t> stages; // Stage of every node
+		std::vector<std::string> moduleNames; // For traces only
+		std::vector<std::string> stageNames;
+		std::vector<std::vector<std::size_t>> consumers;
+		std::vector<std::vector<Path>> produced; // Outputs of the stages, per module
+
+		inline std::size_t add(CmdEntry entry, std::size_t module = 0, std::size_t stage = 0){
+			nodes.emplace_back(std::move(entry));
+			modules.push_back(module);
+			stages.push_back(stage);
+			return nodes.size() - 1;
+		}
 
-			std::unordered_map<std::string, std::vector<std::string>> vars({
-				{"in", inputs},
-				{"out", {output}},
-			});
+		void connect();
 
-			vars.merge(std::unordered_map<std::string, std::vector<std::string>>(flags));
+		// Longest path from every node to the end of the build, weighted by
+		// the recorded durations. Nodes never timed are estimated from the
+		// size of their inputs, scaled by the time per byte of timed ones.
+		std::vector<std::uint64_t> priorities() const;
 
-			ss << cmd.compile(vars).str() << std::endl;
+		// Nodes for which skip returns true count as done without running,
+		// the ones on the longest paths are started first. Commands that
+		// ran are added to trace when given.
+		int run(Log& log, const Scheduler& sched, const std::function<bool(std::size_t)>& skip = {}, Trace* trace = nullptr) const;
 
-			return ss.str();
+		inline int run(Log& log, std::size_t jobs = 0, const std::function<bool(std::size_t)>& skip = {}) const {
+			return run(log, Scheduler{jobs}, skip);
 		}
 	};
 
 	struct Module{
 		std::string name;
-		std::vector<File> files;
-		std::vector<std::string> deps;
+		std::vector<Path> files;
+		std::vector<Path> deps;
 		std::vector<std::string> flags;
 		bool disabled = false;
 	
@@ -736,38 +1557,31 @@ inline const std::string_view C_COMPILER_NAME =
 			name{name}
 		{}
 	
-		inline bool addFile(const File& file){
-			if(!file.exists)
-				return true;
-	
-			files.emplace_back(file);
-			
-			return false;
-		}
+		bool addFile(const File& file);
 	
 		inline bool addFile(std::string_view file){
 			return addFile(File{file});
 		}
 	
-		inline bool addDirectory(const Directory& dir){
-			if(!dir.exists)
-				return true;
-	
-			for(const auto& file: dir.files())
-				files.emplace_back(file);
-	
-			return false;
-		}
+		bool addDirectory(const Directory& dir);
 	
 		inline bool addDirectory(std::string_view dir){
 			return addDirectory(Directory{dir});
 		}
+
+		// ${mod} and ${flags} on top of parent
+		inline std::shared_ptr<const Scope> scope(std::shared_ptr<const Scope> parent) const {
+			return std::make_shared<const Scope>(std::unordered_map<std::string, std::vector<std::string>>{{"mod", {name}}, {"flags", flags}}, std::move(parent));
+		}
 	};
 
 	// TODO: Introduce * extension (for all) and maybe some pattern matching (.c*, etc.)
 	struct Stage{
 		std::string name;
 		Dictionary<std::string, CmdTmpl> cmds;
+		std::unordered_map<std::string, std::vector<std::string>> vars; // Between the global flags and the module's variables
+		bool restat = false; // Applied to every entry of the stage, see CmdEntry::restat
+		std::string pool; // Pool of every entry of the stage instead of the command's one
 	
 		Stage() = default;
 		Stage(std::string_view name):
@@ -776,11 +1590,17 @@ inline const std::string_view C_COMPILER_NAME =
 	
 		virtual ~Stage() = default;
 	
-		virtual std::vector<CmdEntry> apply(Module& mod, const std::unordered_map<std::string, std::vector<std::string>>& flags = {}){
-			(void) mod;
-			(void) flags;
-			return {};
-		};
+		inline std::shared_ptr<const Scope> scope(std::shared_ptr<const Scope> parent) const {
+			return vars.empty() ? parent : std::make_shared<const Scope>(vars, std::move(parent));
+		}
+
+		// Entries of the stage for the files of mod and those produced from
+		// them by earlier stages. Their variables are the global flags, below
+		// them the stage's vars and then the module's (Module::scope).
+		virtual std::vector<CmdEntry> apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags = nullptr) const;
+
+		// Adds everything apply() depends on to h
+		virtual void hash(Hash& h) const;
 	
 		template<std::size_t N>
 		inline bool add(const std::array<std::string, N>& exts, const CmdTmpl& cmd){
@@ -806,44 +1626,18 @@ inline const std::string_view C_COMPILER_NAME =
 	
 	struct Transform: public Stage{
 		std::string outext;
+		bool depfile = false; // Let commands report header dependencies via ${out}.d
 	
 		Transform() = default;
-		Transform(std::string_view name, std::string_view outext):
+		Transform(std::string_view name, std::string_view outext, bool depfile = false):
 			Stage{name},
-			outext{outext}
+			outext{outext},
+			depfile{depfile}
 		{}
 	
-		std::vector<CmdEntry> apply(Module& mod, const std::unordered_map<std::string, std::vector<std::string>>& flags = {}) override {
-			if(cmds.size() <= 0)
-				return {};
-
-			std::vector<CmdEntry> ret;
-			for(const auto& file: mod.files){
-				std::string ext = file.extension();
-				if(cmds.find(ext) == cmds.end())
-					continue;
-	
-				std::string out = file.string();
-				if(bro::starts_with(out, "build/")){
-					out = out.substr(out.find('/', 6)); // Cut build/$stage_name/
-					out = out.substr(out.find('/')); // Cut $mod_name/
-				}
-				out = "build/" + name + "/" + mod.name + "/" + out + outext;
+		std::vector<CmdEntry> apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags = nullptr) const override;
 
-				std::unordered_map<std::string, std::vector<std::string>> flgs = flags;
-				flgs.merge(std::unordered_map<std::string, std::vector<std::string>>{
-					{"mod", {mod.name}
-				}});
-	
-				ret.emplace_back(out, std::vector<std::string>{file.string()}, cmds[ext], flgs);
-			}
-	
-			for(const auto& entry: ret){
-				mod.files.emplace_back(entry.output);
-			}
-	
-			return ret;
-		}
+		void hash(Hash& h) const override;
 	};
 	
 	struct Link: public Stage{
@@ -855,32 +1649,9 @@ inline const std::string_view C_COMPILER_NAME =
 			outtmpl{outtmpl}
 		{}
 	
-		std::vector<CmdEntry> apply(Module& mod, const std::unordered_map<std::string, std::vector<std::string>>& flags = {}) override {
-			if(cmds.size() <= 0)
-				return {};
-
-			CmdEntry ret;
-			ret.output = "build/" + name + "/" + outtmpl.resolve({{"mod", {mod.name}}})[0];
-			ret.dependences = mod.deps;
-			
-			for(const auto& file: mod.files){
-				std::string ext = file.extension();
-				if(cmds.find(ext) == cmds.end())
-					continue;
-				ret.inputs.emplace_back(file.path());
-			}
-
-			ret.cmd = *cmds.begin();
-			ret.flags = {
-				{"mod", {mod.name}},
-				{"flags", mod.flags}
-			};
-			ret.flags.merge(std::unordered_map<std::string, std::vector<std::string>>(flags));
+		std::vector<CmdEntry> apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags = nullptr) const override;
 
-			mod.files.emplace_back(ret.output);
-	
-			return {ret};
-		}
+		void hash(Hash& h) const override;
 	};
 
 	// TODO: Implement something special instead of std::unordered_map<std::string, std::vector<std::string>> so we may take lists from cli args
@@ -894,17 +1665,17 @@ inline const std::string_view C_COMPILER_NAME =
 		Dictionary<std::string, Module> mods;
 		Dictionary<std::string, std::unique_ptr<Stage>> stages;
 		std::unordered_map<std::size_t, std::unordered_set<std::size_t>> mods4stage;
-		std::unordered_map<std::string, std::string> flags;
-
-		inline void _setup_default(){
-			std::string header_path = __FILE__;
-			header = File(header_path);
-			flags["cc"] = C_COMPILER_NAME;
-			flags["cxx"] = CXX_COMPILER_NAME;
-			flags["ld"] = C_COMPILER_NAME;
-			flags["ar"] = "ar"; // TODO DELETE?
-			flags["build"] = "build";
-		}
+		FlatMap<std::string, std::string> flags;
+		std::vector<std::string> args; // Command line exactly as given, fresh() executes it again
+		Database db;
+		Cache cache;
+		Jobserver jobserver;
+		FlatMap<std::string, std::size_t> pools; // See pool()
+		Trace trace; // Enabled by the trace flag, written by build()
+		std::shared_ptr<const Graph> _graph; // Last result of graph()
+		std::uint64_t _graphKey = 0;
+
+		void _setup_default();
 
 		Bro(std::filesystem::path src = __builtin_FILE()):
 			src{src}
@@ -919,103 +1690,73 @@ inline const std::string_view C_COMPILER_NAME =
 			_setup_default();
 		}
 		
-		Bro(int argc, const char** argv, std::filesystem::path src = __builtin_FILE()):
-			src{src},
-			exe{argv[0]}
-		{
-			_setup_default();
+		Bro(int argc, const char** argv, std::filesystem::path src = __builtin_FILE());
 
-			for(int i = 1; i < argc; i++){
-				std::string arg = argv[i];
-				auto eq = arg.find('=');
-				if(eq != std::string_view::npos){
-					std::string name = arg.substr(0, eq);
-					std::string value = arg.substr(eq + 1);
-					flags[name] = value;
-				} else if(arg[0] == '-'){
-					std::string name = arg.substr(1, -1);
-					flags[name] = "no";
-				} else {
-					flags[arg] = "yes";
-				}
-			}
-		}
+		static std::string _readStamp(const std::filesystem::path& p);
 
-		inline bool isFresh(){
-			if(hasFlag("~FRESH"))
-				return isFlagSet("~FRESH");
-			return !(src > exe || header > exe);
+		static inline void _writeStamp(const std::filesystem::path& p, std::string_view stamp){
+			std::ofstream out(p, std::ios::trunc);
+			out << stamp << std::endl;
 		}
 
-		inline void fresh(){
-			if(!isFresh()){
-				int ret = 0;
-				
-				std::string old = exe.string() + ".old";
+		inline std::filesystem::path _stamp() const {
+			return exe.string() + ".fresh";
+		}
 
-				// Save exe to .old
-				ret = exe.copy(log, old);
-				if(ret) std::exit(ret);
-				
-				// Recompile
-				Cmd cmd({String(flags["cxx"]), "-o", exe.path(), src.path()});
-				if((ret = cmd.sync(log))){
-					log.error("Failed to recompile source: {}", src);
-					std::exit(ret);
-				}
+		// Hash of the build script sources and the compiler building them
+		inline std::string _sourceHash(){
+			return Cache::hex(Hash{}.update(flags["cxx"]).update(src.hash()).update(header.hash()).digest());
+		}
 
-				// Run
-				cmd.cmd.clear();
-				cmd.cmd.emplace_back(exe.path());
-				for(const auto& [name, value]: flags){
-					if(name[0] != '~')
-						cmd.cmd.push_back(std::string{name} + "=" + std::string(value));
-				}
+		// The executable is fresh when it was built from sources with the same
+		// contents. Without a stamp next to it (e.g. after bootstrapping by
+		// hand) mtimes decide once and a fresh executable gets stamped.
+		bool isFresh();
 
-				int status = cmd.sync(log);
+		// Precompiles the header (pch flag) with the given defines, rebuilding
+		// it only when its contents change, and returns the arguments needed
+		// to use it
+		std::vector<String> _pch(const std::vector<String>& defines);
 
-				if(status == 0 && isFlagSet("clean", false))
-					std::filesystem::remove(old);
+		// Compiles the implementation section of the header (impl flag) into
+		// an object next to the executable, again only when its contents
+		// change, and returns its path or an empty one on failure
+		std::string _impl();
 
-				std::exit(status);
-			}
-		}
+		// Rebuilds the executable when stale and replaces the running process
+		// with it, passing the command line on unchanged
+		void fresh();
 
-		inline bool hasFlag(const std::string& name){
+		inline bool hasFlag(std::string_view name) const {
 			return flags.find(name) != flags.end();
 		}
 
 		// TODO: What about ~ variant
-		inline std::string getFlag(const std::string& name, std::string_view dflt = ""){
-			if(!hasFlag(name))
-				return std::string(dflt);
-			
-			return std::string(flags[name]);
-		}
+		std::string getFlag(std::string_view name, std::string_view dflt = "") const;
 
-		inline bool setFlag(const std::string& name, std::string_view value = "yes", bool force = true){
-			if(!force && hasFlag(name))
-				return false;
+		bool setFlag(std::string_view name, std::string_view value = "yes", bool force = true);
 
-			flags[name] = value;
-			return true;
-		}
+		bool isFlagSet(std::string_view name, bool dflt = false) const;
 
-		inline bool isFlagSet(const std::string& name, bool dflt = false){
-			if(!hasFlag(name))
-				return dflt;
+		// Size flag in bytes, accepts K, M and G suffixes
+		std::uint64_t getBytes(std::string_view name, std::uint64_t dflt = 0) const;
 
-			return flags[name] != "no" && flags[name] != "0";
+		// Number of job slots; jobs=0 or no flag means the CPUs we may use
+		inline std::size_t jobs(){
+			std::size_t n = std::strtoul(getFlag("jobs", "0").c_str(), nullptr, 10);
+			return n ? n : Scheduler::defaultJobs();
 		}
 
-		inline std::size_t cmd(const CmdTmpl& cmd, bool force = false){
-			if(!force && cmds.find(cmd.name) != cmds.end())
-				return std::numeric_limits<std::size_t>::max();
-
-			auto [ix, _] = cmds.emplace(cmd.name, cmd);
-			return ix;
+		// Failures to stop the build after: 1 by default, keep-going=N or
+		// keep-going alone to never stop
+		inline std::size_t keepGoing(){
+			if(!isFlagSet("keep-going"))
+				return 1;
+			return std::strtoul(getFlag("keep-going").c_str(), nullptr, 10);
 		}
 
+		std::size_t cmd(const CmdTmpl& cmd, bool force = false);
+
 		inline std::size_t cmd(std::string_view name, const std::vector<String>& cmd){
 			return this->cmd(CmdTmpl{name, cmd});
 		}
@@ -1025,16 +1766,7 @@ inline const std::string_view C_COMPILER_NAME =
 			return this->cmd(CmdTmpl{name, cmd});
 		}
 
-		inline std::size_t mod(std::string_view name){
-			std::string n{name};
-
-			if(mods.find(n) != mods.end())
-				return std::numeric_limits<std::size_t>::max();
-
-			auto [ix, ref] = mods.emplace(n, name);
-
-			return ix;
-		}
+		std::size_t mod(std::string_view name);
 
 		// TODO: Test these types (Ix, Path) to be accurate
 		template<typename Ix, typename Path>
@@ -1083,202 +1815,3450 @@ inline const std::string_view C_COMPILER_NAME =
 			return ix;
 		}
 
-		inline std::size_t transform(std::string_view name, std::string_view outext){
-			return stage(name, Transform{name, outext});
+		// Declares a pool running at most depth of the commands put into it
+		// (by CmdTmpl::pool or Stage::pool) at once
+		inline void pool(std::string_view name, std::size_t depth){
+			pools[name] = depth;
+		}
+
+		inline std::size_t transform(std::string_view name, std::string_view outext, bool depfile = false){
+			return stage(name, Transform{name, outext, depfile});
 		}
 
 		inline std::size_t link(std::string_view name, std::string_view outtmpl){
 			return stage(name, Link{name, outtmpl});
 		}
 
-		inline bool useCmd(std::size_t stage, std::size_t cmd, std::string_view ext){
-			if(stage >= stages.size() || cmd >= cmds.size())
-				return true;
+		bool useCmd(std::size_t stage, std::size_t cmd, std::string_view ext);
 
-			return stages[stage]->add(ext, cmds[cmd]);
+		bool applyMod(std::size_t stage, std::size_t mod);
+
+		// The flags as the outermost scope of all commands
+		std::shared_ptr<const Scope> _scope() const;
+
+		// Hash of everything the graph is made from: flags, stages, modules
+		// and which stages apply to which modules
+		std::uint64_t _fingerprint() const;
+
+		// Entries of every stage applied to its modules, connected. The graph
+		// is shared by build(), ninja() and makefile() and only made again
+		// when the fingerprint changes.
+		std::shared_ptr<const Graph> graph();
+
+		int build();
+
+		int run();
+
+		int ninja(std::ostream& out);
+
+		int ninja();
+
+		int makefile(std::ostream& out);
+
+		int makefile();
+	};
+
+	template<typename CharT, typename Traits>
+	inline std::basic_ostream<CharT, Traits>& operator<<(std::basic_ostream<CharT, Traits>& out, const File& file){
+		std::time_t tt = static_cast<std::time_t>(file.time / 1000000000);
+		std::tm* tm = std::localtime(&tt);
+		return out << "bro::File{'exists': " << file.exists << ", 'path': " << file.path() << ", 'time': '" << std::put_time(tm, "%Y-%m-%d %H:%M:%S") << "'}";
+	}
+
+	template<typename CharT, typename Traits>
+	inline std::basic_ostream<CharT, Traits>& operator<<(std::basic_ostream<CharT, Traits>& out, const Path& path){
+		return out << path.str();
+	}
+
+	template<typename CharT, typename Traits>
+	inline std::basic_ostream<CharT, Traits>& operator<<(std::basic_ostream<CharT, Traits>& out, const CmdTmpl& tmpl){
+		out << "bro::CmdTmpl{'name': " << std::quoted(tmpl.name) << ", 'cmd': { ";
+		for(const auto& e: tmpl.cmd)
+			out << std::quoted(e) << " ";
+		return out << "}}";
+	}
+}
+
+// Implementation, compiled in the one file defining BRO_IMPLEMENTATION.
+// BRO_NO_IMPLEMENTATION skips it when it is linked from elsewhere instead.
+#if defined(BRO_IMPLEMENTATION) && !defined(BRO_NO_IMPLEMENTATION)
+namespace bro{
+	String String::escape() const {
+		const std::string needs = "\" \n\r";
+		if(find_first_of(needs) != std::string::npos){
+			std::stringstream ss;
+			ss << std::quoted(*this);
+			return ss.str();
+		}
+
+		return *this;
+	}
+
+	std::vector<String> String::resolve(const std::unordered_map<std::string, std::vector<std::string>>& dict) const {
+		std::vector<String> ret;
+		std::string buf;
+		StrTmpl(*this).expand(Scope{dict}, ret, buf);
+		return ret;
+	}
+
+	std::unordered_set<std::string> String::variables() const {
+		std::unordered_set<std::string> ret;
+
+		std::string::size_type pos = 0;
+		while((pos = find('$', pos)) != std::string::npos){
+			if(pos + 1 >= size() || at(pos + 1) != '{'){
+				pos += 2;
+				continue;
+			}
+
+			std::string::size_type end = find('}', pos);
+			if(end == std::string::npos)
+				return ret;
+
+			ret.emplace(substr(pos + 2, end - pos - 2));
+			pos = end;
+		}
+
+		return ret;
+	}
+
+	const std::vector<std::string>* Scope::find(const std::string& name) const {
+		for(const Scope* scope = this; scope; scope = scope->parent.get()){
+			auto it = scope->vars.find(name);
+			if(it != scope->vars.end())
+				return &it->second;
+		}
+
+		return nullptr;
+	}
+
+	StrTmpl::StrTmpl(std::string_view str){
+		auto literal = [&](std::string_view text){
+			if(text.empty())
+				return;
+			if(tokens.empty() || tokens.back().var)
+				tokens.push_back({});
+			tokens.back().text += text;
+		};
+
+		std::size_t pos = 0;
+		while(pos < str.size()){
+			std::size_t dollar = str.find('$', pos);
+			if(dollar == std::string_view::npos || dollar + 1 >= str.size()){
+				literal(str.substr(pos));
+				return;
+			}
+
+			literal(str.substr(pos, dollar - pos));
+
+			if(str[dollar + 1] != '{'){
+				// $$ is an escaped $, any other $ stays as it is
+				literal("$");
+				pos = dollar + (str[dollar + 1] == '$' ? 2 : 1);
+				continue;
+			}
+
+			std::size_t end = str.find('}', dollar);
+			if(end == std::string_view::npos){
+				literal(str.substr(dollar));
+				return;
+			}
+
+			tokens.push_back({std::string{str.substr(dollar + 2, end - dollar - 2)}, true});
+			pos = end + 1;
+		}
+	}
+
+	void StrTmpl::expand(const Scope& scope, std::vector<String>& out, std::string& buf) const {
+		buf.clear();
+		_expand(scope, 0, out, buf);
+	}
+
+	void StrTmpl::_expand(const Scope& scope, std::size_t ix, std::vector<String>& out, std::string& buf) const {
+		for(; ix < tokens.size(); ix++){
+			const Token& token = tokens[ix];
+			if(!token.var){
+				buf += token.text;
+				continue;
+			}
+
+			const std::vector<std::string>* vals = scope.find(token.text);
+			if(!vals || vals->empty())
+				continue;
+
+			if(vals->size() == 1){
+				buf += (*vals)[0];
+				continue;
+			}
+
+			std::size_t len = buf.size();
+			for(const auto& val: *vals){
+				buf += val;
+				_expand(scope, ix + 1, out, buf);
+				buf.resize(len);
+			}
+			return;
+		}
+
+		out.emplace_back(buf);
+	}
+
+	std::uint64_t Hash::read64(const unsigned char* p){
+		std::uint64_t x;
+		std::memcpy(&x, p, sizeof(x));
+		return x;
+	}
+
+	std::uint32_t Hash::read32(const unsigned char* p){
+		std::uint32_t x;
+		std::memcpy(&x, p, sizeof(x));
+		return x;
+	}
+
+	std::uint64_t Hash::round(std::uint64_t acc, std::uint64_t input){
+		acc += input * P2;
+		acc = rotl(acc, 31);
+		return acc * P1;
+	}
+
+	Hash& Hash::update(const void* data, std::size_t len){
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		const unsigned char* end = p + len;
+		total += len;
+
+		if(buffered + len < 32){
+			std::memcpy(buf + buffered, p, len);
+			buffered += len;
+			return *this;
+		}
+
+		if(buffered){
+			std::memcpy(buf + buffered, p, 32 - buffered);
+			p += 32 - buffered;
+			for(int i = 0; i < 4; i++)
+				v[i] = round(v[i], read64(buf + i * 8));
+			buffered = 0;
+		}
+
+		for(; p + 32 <= end; p += 32){
+			for(int i = 0; i < 4; i++)
+				v[i] = round(v[i], read64(p + i * 8));
+		}
+
+		buffered = end - p;
+		std::memcpy(buf, p, buffered);
+
+		return *this;
+	}
+
+	Hash& Hash::update(std::string_view str){
+		// Length prefix keeps ("ab", "c") and ("a", "bc") apart
+		update(static_cast<std::uint64_t>(str.size()));
+		return update(str.data(), str.size());
+	}
+
+	std::uint64_t Hash::digest() const {
+		std::uint64_t h;
+		if(total >= 32){
+			h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+			for(int i = 0; i < 4; i++)
+				h = merge(h, v[i]);
+		} else{
+			h = seed + P5;
+		}
+
+		h += total;
+
+		const unsigned char* p = buf;
+		const unsigned char* end = buf + buffered;
+		for(; p + 8 <= end; p += 8){
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * P1 + P4;
+		}
+
+		if(p + 4 <= end){
+			h ^= static_cast<std::uint64_t>(read32(p)) * P1;
+			h = rotl(h, 23) * P2 + P3;
+			p += 4;
+		}
+
+		for(; p < end; p++){
+			h ^= (*p) * P5;
+			h = rotl(h, 11) * P1;
+		}
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+
+		return h;
+	}
+
+	std::uint64_t Hash::file(const std::filesystem::path& p){
+		std::ifstream in(p, std::ios::binary);
+		if(!in)
+			return 0;
+
+		Hash h;
+		char chunk[1 << 16];
+		while(in){
+			in.read(chunk, sizeof(chunk));
+			h.update(chunk, in.gcount());
+		}
+		return h.digest();
+	}
+
+	Path::Arena& Path::_arena(){
+		static Arena arena;
+		return arena;
+	}
+
+	std::uint32_t Path::_intern(std::string_view p){
+		if(p.empty())
+			return 0;
+
+		Arena& arena = _arena();
+		{
+			std::shared_lock<std::shared_mutex> lock(arena.mtx);
+			auto it = arena.ids.find(p);
+			if(it != arena.ids.end())
+				return it->second;
+		}
+
+		std::unique_lock<std::shared_mutex> lock(arena.mtx);
+		auto it = arena.ids.find(p);
+		if(it != arena.ids.end())
+			return it->second;
+
+		std::uint32_t id = static_cast<std::uint32_t>(arena.strings.size());
+		arena.ids.emplace(arena.strings.emplace_back(p), id);
+		return id;
+	}
+
+	std::size_t Path::count(){
+		Arena& arena = _arena();
+		std::shared_lock<std::shared_mutex> lock(arena.mtx);
+		return arena.strings.size();
+	}
+
+	const std::string& Path::str() const {
+		Arena& arena = _arena();
+		std::shared_lock<std::shared_mutex> lock(arena.mtx);
+		return arena.strings[id];
+	}
+
+	std::string_view Path::extension() const {
+		std::string_view p = str();
+		std::size_t slash = p.rfind('/');
+		std::size_t name = slash == std::string_view::npos ? 0 : slash + 1;
+		std::size_t dot = p.rfind('.');
+		// Like filename(), "." and ".." and dot files have no extension
+		if(dot == std::string_view::npos || dot <= name || p.substr(name) == "..")
+			return {};
+		return p.substr(dot);
+	}
+
+	Stat Stat::of(const std::string& p){
+		Stat st;
+#if defined(__linux__) && defined(STATX_MTIME)
+		struct statx sx;
+		if(statx(AT_FDCWD, p.c_str(), 0, STATX_TYPE | STATX_MTIME | STATX_SIZE | STATX_INO, &sx))
+			return st;
+
+		st.exists = true;
+		st.directory = S_ISDIR(sx.stx_mode);
+		st.mtime = static_cast<std::int64_t>(sx.stx_mtime.tv_sec) * 1000000000 + sx.stx_mtime.tv_nsec;
+		st.size = sx.stx_size;
+		st.ino = sx.stx_ino;
+#else
+		struct stat sb;
+		if(::stat(p.c_str(), &sb))
+			return st;
+
+		st.exists = true;
+		st.directory = S_ISDIR(sb.st_mode);
+		st.mtime = static_cast<std::int64_t>(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+		st.size = sb.st_size;
+		st.ino = sb.st_ino;
+#endif
+		return st;
+	}
+
+	void StatCache::invalidate(const std::string& p){
+		if(StatCache* cache = active()){
+			std::unique_lock<std::shared_mutex> lock(cache->mtx);
+			cache->stats.erase(p);
+		}
+	}
+
+	Stat StatCache::get(const std::string& p){
+		{
+			std::shared_lock<std::shared_mutex> lock(mtx);
+			auto it = stats.find(p);
+			if(it != stats.end())
+				return it->second;
+		}
+
+		Stat st = Stat::of(p);
+
+		std::unique_lock<std::shared_mutex> lock(mtx);
+		return stats.emplace(p, st).first->second;
+	}
+
+	File::File(std::filesystem::path p):
+		std::filesystem::path{p}
+	{
+		Stat st = StatCache::stat(string());
+		exists = st.exists;
+		time = st.mtime;
+		size = st.size;
+		ino = st.ino;
+	}
+
+	std::uint64_t File::hash() const {
+		if(!_hashed){
+			_hash = exists ? Hash::file(path()) : 0;
+			_hashed = true;
+		}
+		return _hash;
+	}
+
+	int File::copy(Log& log, std::filesystem::path to) const {
+		if(!exists){
+			log.error("File does not exist {}", path());
+			return 1;
+		}
+
+		std::error_code ec;
+		std::filesystem::copy(*this, to, std::filesystem::copy_options::overwrite_existing, ec);
+		StatCache::invalidate(to.string());
+		
+		if(ec){
+			log.error("Failed to copy from {} to {}: {}", path(), to, ec);
+			return ec.value();
+		}
+
+		return 0;
+	}
+
+	int File::move(Log& log, std::filesystem::path to){
+		if(!exists){
+			log.error("File does not exist {}", path());
+			return 1;
+		}
+
+		std::error_code ec;
+		std::filesystem::rename(path(), to, ec);
+		StatCache::invalidate(string());
+		StatCache::invalidate(to.string());
+		
+		if(ec){
+			log.error("Failed to move from {} to {}: {}", path(), to, ec);
+			return ec.value();
+		}
+
+		*this = to;
+
+		return 0;
+	}
+
+	int Directory::copyTree(Log& log, std::filesystem::path p) const {
+		log.info("Copying tree {} => {}", path(), p);
+
+		if(!exists){
+			log.error("File does not exist {}", path());
+			return 1;
+		}
+		
+		std::error_code ec;
+
+		std::filesystem::create_directories(p, ec);
+
+		if(ec){
+			log.error("Failed to create directory {}: {}", p, ec);
+			return ec.value();
+		}
+
+		for(const auto& e: std::filesystem::recursive_directory_iterator(path())){
+			if(std::filesystem::is_directory(e.status())){
+				std::filesystem::path p2 = p / std::filesystem::relative(e.path(), path());
+				std::filesystem::create_directory(p2, ec);
+
+				if(ec){
+					log.error("Failed to create directory {}: {}", p2, ec);
+					return ec.value();
+				}
+			}
+		}
+
+		return 0;
+	}
+
+	std::vector<File> Directory::files() const {
+		std::vector<File> files;
+		if(!exists)
+			return files;
+
+		// The entry type comes from the directory listing, File stats once
+		for(const auto& e: std::filesystem::recursive_directory_iterator(path())){
+			if(e.is_regular_file()){
+				files.emplace_back(e.path());
+			}
+		}
+
+		return files;
+	}
+
+	bool Directory::make(Log& log) const {
+		if(exists)
+			return false;
+
+		log.info("Making directory: {}", path());
+		std::filesystem::create_directories(path());
+		for(std::filesystem::path p = path(); !p.empty(); p = p.parent_path())
+			StatCache::invalidate(p.string());
+		return true;
+	}
+
+	void Runnable::start(Log& log, std::function<void(int)> done) const {
+		std::thread([this, &log, done](){
+			done(sync(log));
+		}).detach();
+	}
+
+	std::future<int> Runnable::_async(Log& log) const {
+		auto promise = std::make_shared<std::promise<int>>();
+		std::future<int> ret = promise->get_future();
+		start(log, [promise](int status){
+			promise->set_value(status);
+		});
+		return ret;
+	}
+
+	Exit Exit::from(int wstatus){
+		Exit e;
+		if(WIFEXITED(wstatus))
+			e.code = WEXITSTATUS(wstatus);
+		else if(WIFSIGNALED(wstatus))
+			e.signal = WTERMSIG(wstatus);
+		return e;
+	}
+
+	LogWriter::~LogWriter(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		wake.notify_one();
+		thread.join();
+	}
+
+	void LogWriter::push(int fd, std::string text){
+		Message* msg = new Message{head.load(std::memory_order_relaxed), fd, std::move(text)};
+		while(!head.compare_exchange_weak(msg->next, msg));
+		pushed++;
+
+		// Only take the lock when the writer may be waiting for it
+		if(sleeping.load()){
+			std::lock_guard<std::mutex> lock(mtx);
+			wake.notify_one();
+		}
+	}
+
+	void LogWriter::flush(){
+		std::uint64_t target = pushed.load();
+		std::unique_lock<std::mutex> lock(mtx);
+		drained.wait(lock, [&](){ return written >= target; });
+	}
+
+	void LogWriter::loop(){
+		std::string buf;
+		while(true){
+			Message* list = head.exchange(nullptr);
+			if(!list){
+				std::unique_lock<std::mutex> lock(mtx);
+				sleeping = true;
+				wake.wait(lock, [&](){ return stop || head.load(); });
+				sleeping = false;
+				if(stop && !head.load())
+					return;
+				continue;
+			}
+
+			// Newest first, reverse it
+			Message* msg = nullptr;
+			while(list){
+				Message* next = list->next;
+				list->next = msg;
+				msg = list;
+				list = next;
+			}
+
+			// One write per run of messages going to the same descriptor
+			std::uint64_t count = 0;
+			int fd = -1;
+			while(msg){
+				if(msg->fd != fd){
+					_write(fd, buf);
+					buf.clear();
+					fd = msg->fd;
+				}
+				buf += msg->text;
+
+				Message* next = msg->next;
+				delete msg;
+				msg = next;
+				count++;
+			}
+			_write(fd, buf);
+			buf.clear();
+
+			std::lock_guard<std::mutex> lock(mtx);
+			written += count;
+			drained.notify_all();
+		}
+	}
+
+	void LogWriter::_write(int fd, std::string_view text){
+		while(!text.empty()){
+			ssize_t n = ::write(fd, text.data(), text.size());
+			if(n < 0){
+				if(errno == EINTR)
+					continue;
+				return;
+			}
+			text.remove_prefix(n);
+		}
+	}
+
+	Reaper::~Reaper(){
+		if(!thread.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		notify();
+		thread.join();
+
+		close(wake[0]);
+		close(wake[1]);
+	}
+
+	Exit Reaper::reap(pid_t pid){
+		int wstatus = 0;
+		rusage usage{};
+		while(wait4(pid, &wstatus, 0, &usage) < 0){
+			if(errno != EINTR)
+				return Exit{127, 0};
+		}
+
+		Exit e = Exit::from(wstatus);
+		e.usage = usage;
+		return e;
+	}
+
+	void Reaper::watch(pid_t pid, Callback done){
+		int fd = -1;
+#ifdef SYS_pidfd_open
+		if(thread.joinable())
+			fd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#endif
+
+		if(fd < 0){
+			std::thread([pid, done](){
+				done(reap(pid));
+			}).detach();
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			watched.emplace(fd, Watch{pid, std::move(done)});
+		}
+		notify();
+	}
+
+	void Reaper::terminate(int sig){
+		// Children are unwatched before they are reaped, so none of the
+		// pids can have been reused yet
+		std::lock_guard<std::mutex> lock(mtx);
+		for(const auto& [fd, w]: watched)
+			kill(-w.pid, sig);
+	}
+
+	void Reaper::_interrupt(int sig){
+		int saved = errno;
+		interrupted = sig;
+		char c = 0;
+		while(write(wakefd, &c, 1) < 0 && errno == EINTR);
+		errno = saved;
+	}
+
+	void Reaper::loop(){
+		std::vector<pollfd> fds;
+		while(true){
+			fds.clear();
+			fds.push_back({wake[0], POLLIN, 0});
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				if(stop && watched.empty())
+					return;
+
+				for(const auto& [fd, _]: watched)
+					fds.push_back({fd, POLLIN, 0});
+			}
+
+			if(poll(fds.data(), fds.size(), -1) < 0)
+				continue;
+
+			if(fds[0].revents){
+				char buf[64];
+				while(read(wake[0], buf, sizeof(buf)) == sizeof(buf));
+			}
+
+			if(int sig = interrupted){
+				terminate(sig);
+				signal(sig, SIG_DFL);
+				raise(sig);
+			}
+
+			for(std::size_t i = 1; i < fds.size(); i++){
+				if(!fds[i].revents)
+					continue;
+
+				Watch w;
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					auto it = watched.find(fds[i].fd);
+					w = std::move(it->second);
+					watched.erase(it);
+				}
+
+				close(fds[i].fd);
+				w.done(reap(w.pid));
+			}
+		}
+	}
+
+	Workers::~Workers(){
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		for(auto& thread: threads)
+			thread.join();
+	}
+
+	Workers& Workers::instance(){
+		static Workers workers(Scheduler::defaultJobs());
+		return workers;
+	}
+
+	void Workers::post(std::function<void()> task){
+		std::lock_guard<std::mutex> lock(mtx);
+		tasks.push_back(std::move(task));
+		if(threads.size() < size && threads.size() < tasks.size() + busy)
+			threads.emplace_back([this](){ loop(); });
+		cv.notify_one();
+	}
+
+	void Workers::wait(){
+		std::unique_lock<std::mutex> lock(mtx);
+		idle.wait(lock, [&](){ return tasks.empty() && busy == 0; });
+	}
+
+	void Workers::loop(){
+		std::unique_lock<std::mutex> lock(mtx);
+		while(true){
+			cv.wait(lock, [&](){ return stop || !tasks.empty(); });
+			if(tasks.empty())
+				return;
+
+			std::function<void()> task = std::move(tasks.front());
+			tasks.pop_front();
+			busy++;
+			lock.unlock();
+			task();
+			lock.lock();
+			busy--;
+			if(tasks.empty() && busy == 0)
+				idle.notify_all();
+		}
+	}
+
+	String Cmd::str() const {
+		std::stringstream ss;
+		for(const auto& e: cmd)
+			ss << " " << e.escape();
+
+		return ss.str().substr(1);
+	}
+
+	std::uint64_t Cmd::hash() const {
+		Hash h;
+		h.update(static_cast<std::uint64_t>(shell));
+		for(const auto& e: cmd)
+			h.update(e);
+		return h.digest();
+	}
+
+	std::vector<std::string> Cmd::argv() const {
+		if(shell)
+			return {"/bin/sh", "-c", str()};
+
+		std::vector<std::string> ret;
+		for(const auto& e: cmd)
+			if(!e.empty())
+				ret.emplace_back(e);
+
+		return ret;
+	}
+
+	std::string Cmd::program() const {
+		std::vector<std::string> args = argv();
+		if(args.empty())
+			return {};
+		if(args[0].find('/') != std::string::npos)
+			return args[0];
+
+		const char* env = std::getenv("PATH");
+		std::string_view dirs = env ? env : "/usr/bin:/bin";
+		while(true){
+			std::size_t colon = dirs.find(':');
+			std::string_view dir = dirs.substr(0, colon);
+			std::string p = (dir.empty() ? std::string{"."} : std::string{dir}) + "/" + args[0];
+			Stat st = StatCache::stat(p);
+			if(st.exists && !st.directory)
+				return p;
+
+			if(colon == std::string_view::npos)
+				return {};
+			dirs.remove_prefix(colon + 1);
+		}
+	}
+
+	int Cmd::spawn(Log& log, pid_t& pid, int out, bool group) const {
+		std::vector<std::string> args = argv();
+		if(args.empty()){
+			log.error("Failed to run: empty command");
+			return EINVAL;
+		}
+
+		std::vector<char*> ptrs;
+		for(auto& arg: args)
+			ptrs.push_back(arg.data());
+		ptrs.push_back(nullptr);
+
+		posix_spawn_file_actions_t actions;
+		posix_spawn_file_actions_init(&actions);
+		if(out >= 0){
+			posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+			posix_spawn_file_actions_adddup2(&actions, out, STDERR_FILENO);
+		}
+
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+		if(group){
+			posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+			posix_spawnattr_setpgroup(&attr, 0);
+		}
+
+		int err = posix_spawnp(&pid, ptrs[0], &actions, &attr, ptrs.data(), environ);
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&actions);
+		if(err){
+			log.error("Failed to run {}: {}", args[0], std::strerror(err));
+			return err;
+		}
+
+		return 0;
+	}
+
+	int Cmd::_capture(){
+		int fd = -1;
+#if defined(SYS_memfd_create) && defined(MFD_CLOEXEC)
+		fd = static_cast<int>(syscall(SYS_memfd_create, "bro", MFD_CLOEXEC));
+		if(fd >= 0)
+			return fd;
+#endif
+
+		char path[] = "/tmp/bro-XXXXXX";
+		fd = mkstemp(path);
+		if(fd >= 0){
+			unlink(path);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+
+		return fd;
+	}
+
+	void Cmd::_report(Log& log, int out, const Exit& e, const std::string& line){
+		std::string text;
+		if(log.quiet && !e.ok())
+			text = "CMD: " + line + "\n";
+
+		if(out >= 0){
+			if(!log.quiet || !e.ok()){
+				char buf[4096];
+				off_t off = 0;
+				ssize_t n;
+				while((n = pread(out, buf, sizeof(buf), off)) != 0){
+					if(n < 0){
+						if(errno == EINTR)
+							continue;
+						break;
+					}
+					text.append(buf, n);
+					off += n;
+				}
+			}
+			close(out);
+		}
+
+		if(!text.empty())
+			log.emit(STDOUT_FILENO, std::move(text));
+	}
+
+	Exit Cmd::exec(Log& log) const {
+		if(cmd.size() == 0){
+			log.error("Cannot run empty CMD...");
+			return Exit{-1, 0};
+		}
+
+		String line = str();
+		log.cmd(line);
+
+		int out = log.capture ? _capture() : -1;
+		pid_t pid;
+		if(spawn(log, pid, out)){
+			if(out >= 0)
+				close(out);
+			return Exit{127, 0};
+		}
+
+		Exit e = Reaper::reap(pid);
+		_report(log, out, e, line);
+		if(e.signal)
+			log.error("Process {} killed by signal {}: {}", pid, e.signal, strsignal(e.signal));
+
+		return e;
+	}
+
+	void Cmd::launch(Log& log, std::function<void(const Exit&)> done) const {
+		if(cmd.size() == 0){
+			log.error("Cannot run empty CMD...");
+			return done(Exit{-1, 0});
+		}
+		
+		String line = str();
+		log.cmd(line);
+
+		int out = log.capture ? _capture() : -1;
+		pid_t pid;
+		if(spawn(log, pid, out, true)){
+			if(out >= 0)
+				close(out);
+			return done(Exit{127, 0});
+		}
+
+		Reaper::instance().watch(pid, [&log, pid, out, line, done](const Exit& e){
+			_report(log, out, e, line);
+			if(e.signal)
+				log.error("Process {} killed by signal {}: {}", pid, e.signal, strsignal(e.signal));
+			done(e);
+		});
+	}
+
+	std::shared_ptr<const std::vector<StrTmpl>> CmdTmpl::_parse(const std::vector<String>& cmd){
+		auto program = std::make_shared<std::vector<StrTmpl>>();
+		program->reserve(cmd.size());
+		for(const auto& arg: cmd)
+			program->emplace_back(arg);
+		return program;
+	}
+
+	std::unordered_set<std::string> CmdTmpl::variables() const {
+		std::unordered_set<std::string> ret;
+		if(program){
+			for(const auto& arg: *program)
+				for(const auto& token: arg.tokens)
+					if(token.var)
+						ret.insert(token.text);
+		}
+
+		return ret;
+	}
+
+	bool CmdTmpl::uses(std::string_view var) const {
+		return program && std::any_of(program->begin(), program->end(), [&](const StrTmpl& arg){ return arg.uses(var); });
+	}
+
+	void CmdTmpl::resolve(const Scope& scope, std::vector<String>& argv) const {
+		if(!program)
+			return;
+
+		std::string buf;
+		for(const auto& arg: *program)
+			arg.expand(scope, argv, buf);
+	}
+
+	std::vector<String> CmdTmpl::resolve(const Scope& scope) const {
+		std::vector<String> argv;
+		if(program)
+			argv.reserve(program->size());
+		resolve(scope, argv);
+		return argv;
+	}
+
+	std::vector<std::filesystem::path> Cgroup::_dirs(std::string_view controller){
+		std::vector<std::filesystem::path> ret;
+		std::ifstream in("/proc/self/cgroup");
+		std::string line;
+		while(std::getline(in, line)){
+			// id:controllers:path
+			std::size_t a = line.find(':');
+			std::size_t b = line.find(':', a + 1);
+			if(a == std::string::npos || b == std::string::npos)
+				continue;
+
+			std::string controllers = line.substr(a + 1, b - a - 1);
+			std::filesystem::path base = "/sys/fs/cgroup";
+			if(controller.empty()){
+				if(!controllers.empty())
+					continue;
+				// Hybrid setups mount v2 beside the v1 controllers
+				if(!std::filesystem::exists(base / "cgroup.controllers"))
+					base /= "unified";
+			} else{
+				if(("," + controllers + ",").find("," + std::string(controller) + ",") == std::string::npos)
+					continue;
+				base /= controllers;
+			}
+
+			std::filesystem::path rel = std::filesystem::path(line.substr(b + 1)).relative_path();
+			for(; ; rel = rel.parent_path()){
+				std::error_code ec;
+				if(std::filesystem::is_directory(base / rel, ec))
+					ret.push_back(base / rel);
+				if(rel.empty())
+					break;
+			}
+			break;
+		}
+
+		return ret;
+	}
+
+	std::string Cgroup::_read(const std::filesystem::path& p){
+		std::ifstream in(p);
+		std::string ret;
+		std::getline(in, ret);
+		return ret;
+	}
+
+	double Cgroup::cpus(){
+		double ret = 0;
+		for(const auto& dir: _dirs("")){
+			// "max 100000" or "<quota> <period>"
+			std::string max = _read(dir / "cpu.max");
+			double quota = 0;
+			double period = 0;
+			if(std::sscanf(max.c_str(), "%lf %lf", &quota, &period) == 2 && quota > 0 && period > 0 && (!ret || quota / period < ret))
+				ret = quota / period;
+		}
+		if(ret)
+			return ret;
+
+		for(const auto& dir: _dirs("cpu")){
+			double quota = std::strtod(_read(dir / "cpu.cfs_quota_us").c_str(), nullptr);
+			double period = std::strtod(_read(dir / "cpu.cfs_period_us").c_str(), nullptr);
+			if(quota > 0 && period > 0 && (!ret || quota / period < ret))
+				ret = quota / period;
+		}
+
+		return ret;
+	}
+
+	std::uint64_t Cgroup::memory(){
+		std::uint64_t ret = 0;
+		for(const auto& dir: _dirs("")){
+			std::uint64_t max = std::strtoull(_read(dir / "memory.max").c_str(), nullptr, 10);
+			if(max && (!ret || max < ret))
+				ret = max;
+		}
+		if(ret)
+			return ret;
+
+		// v1 reports no limit as a huge number rounded to pages
+		for(const auto& dir: _dirs("memory")){
+			std::uint64_t max = std::strtoull(_read(dir / "memory.limit_in_bytes").c_str(), nullptr, 10);
+			if(max && max < (1ULL << 62) && (!ret || max < ret))
+				ret = max;
+		}
+
+		return ret;
+	}
+
+	std::size_t Scheduler::defaultJobs(){
+		static const std::size_t jobs = [](){
+			std::size_t n = std::thread::hardware_concurrency();
+
+			cpu_set_t set;
+			if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+				n = n ? std::min<std::size_t>(n, CPU_COUNT(&set)) : CPU_COUNT(&set);
+
+			double quota = Cgroup::cpus();
+			if(quota > 0)
+				n = n ? std::min<std::size_t>(n, static_cast<std::size_t>(std::ceil(quota))) : std::ceil(quota);
+
+			return n ? n : 1;
+		}();
+		return jobs;
+	}
+
+	Jobserver::~Jobserver(){
+		if(rfd >= 0 && rfd != wfd)
+			close(rfd);
+		if(wfd >= 0)
+			close(wfd);
+
+		if(serving()){
+			close(served[0]);
+			close(served[1]);
+			if(hadMakeflags)
+				setenv("MAKEFLAGS", makeflags.c_str(), 1);
+			else
+				unsetenv("MAKEFLAGS");
+		}
+	}
+
+	bool Jobserver::connect(Log& log, std::string_view flags){
+		// The last one wins, like in make itself
+		std::string_view auth;
+		for(std::string_view opt: {"--jobserver-auth=", "--jobserver-fds="}){
+			std::size_t pos = flags.rfind(opt);
+			if(pos != std::string_view::npos && (auth.empty() || flags.data() + pos > auth.data())){
+				auth = flags.substr(pos + opt.size());
+				auth = auth.substr(0, auth.find(' '));
+			}
+		}
+
+		if(auth.empty())
+			return true;
+
+		if(auth.substr(0, 5) == "fifo:"){
+			std::string path(auth.substr(5));
+			rfd = wfd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+			if(rfd < 0){
+				log.warning("Cannot open jobserver fifo {}: {}", path, std::strerror(errno));
+				return true;
+			}
+			return false;
+		}
+
+		int r = -1;
+		int w = -1;
+		if(std::sscanf(std::string(auth).c_str(), "%d,%d", &r, &w) != 2 || r < 0 || w < 0)
+			return true;
+
+		// make only passes the pipe to recipes it knows to be sub-makes
+		if(fcntl(r, F_GETFD) < 0 || fcntl(w, F_GETFD) < 0){
+			log.warning("Jobserver pipe {} is not open, prefix the rule with + to pass it", auth);
+			return true;
+		}
+
+		rfd = _reopen(r);
+		wfd = fcntl(w, F_DUPFD_CLOEXEC, 0);
+		if(rfd < 0 || wfd < 0){
+			log.warning("Cannot use jobserver pipe {}: {}", auth, std::strerror(errno));
+			return true;
+		}
+
+		return false;
+	}
+
+	bool Jobserver::serve(Log& log, std::size_t jobs){
+		// Inherited by the children, make looks for it in MAKEFLAGS
+		if(pipe(served)){
+			log.warning("Cannot create jobserver pipe: {}", std::strerror(errno));
+			return true;
+		}
+
+		rfd = _reopen(served[0]);
+		wfd = fcntl(served[1], F_DUPFD_CLOEXEC, 0);
+		if(rfd < 0 || wfd < 0){
+			log.warning("Cannot create jobserver pipe: {}", std::strerror(errno));
+			return true;
+		}
+
+		for(std::size_t i = 1; i < jobs; i++)
+			give('+');
+
+		const char* old = std::getenv("MAKEFLAGS");
+		hadMakeflags = old;
+		makeflags = old ? old : "";
+
+		std::stringstream ss;
+		ss << makeflags << " -j" << jobs << " --jobserver-auth=" << served[0] << "," << served[1];
+		setenv("MAKEFLAGS", ss.str().c_str(), 1);
+
+		return false;
+	}
+
+	int Jobserver::_reopen(int fd){
+		std::string proc = "/proc/self/fd/" + std::to_string(fd);
+		int ret = open(proc.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if(ret >= 0)
+			return ret;
+
+		// Without /proc reads may block while another process races for a token
+		return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	}
+
+	bool Jobserver::take(char& token) const {
+		ssize_t n;
+		while((n = read(rfd, &token, 1)) < 0 && errno == EINTR);
+		return n == 1;
+	}
+
+	void Jobserver::give(char token) const {
+		while(write(wfd, &token, 1) < 0 && errno == EINTR);
+	}
+
+	bool Jobserver::wait(int wake) const {
+		pollfd fds[2] = {{rfd, POLLIN, 0}, {wake, POLLIN, 0}};
+		while(poll(fds, 2, -1) < 0){
+			if(errno != EINTR)
+				return true;
+		}
+
+		return (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)) && !(fds[0].revents & POLLIN);
+	}
+
+	int Scheduler::run(Log& log, std::size_t count, const Start& start, const std::vector<std::vector<std::size_t>>& consumers, const std::vector<std::uint64_t>& priority, const std::vector<Need>& needs) const {
+		std::vector<std::size_t> pending(count, 0);
+		for(const auto& edges: consumers)
+			for(std::size_t ix: edges)
+				pending[ix]++;
+
+		auto later = [&](std::size_t a, std::size_t b){
+			std::uint64_t pa = a < priority.size() ? priority[a] : 0;
+			std::uint64_t pb = b < priority.size() ? priority[b] : 0;
+			return pa != pb ? pa < pb : a > b;
+		};
+		std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(later)> ready(later);
+		for(std::size_t i = 0; i < count; i++)
+			if(pending[i] == 0)
+				ready.push(i);
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<std::pair<std::size_t, int>> done;
+		std::size_t running = 0;
+		std::size_t finished = 0;
+		std::size_t failed = 0;
+		bool stopping = false;
+		bool terminated = false;
+		int ret = 0;
+
+		std::vector<std::size_t> pooled(pools.size() + 1, 0); // Running jobs per pool
+		std::uint64_t used = 0; // Expected memory of the running jobs
+		std::vector<std::size_t> blocked; // Ready, but waiting for a pool or memory
+		auto fits = [&](std::size_t ix){
+			if(ix >= needs.size())
+				return true;
+
+			const Need& need = needs[ix];
+			if(need.pool){
+				std::size_t depth = pools.entries[need.pool - 1].second;
+				if(depth && pooled[need.pool] >= depth)
+					return false;
+			}
+
+			return !memory || running == 0 || used + need.memory <= memory;
+		};
+
+		// Tokens are read on a thread of their own while the loop wants one
+		const Jobserver* js = jobserver && jobserver->enabled() ? jobserver : nullptr;
+		std::vector<char> spare; // Taken and not used yet
+		std::vector<char> held; // One for every running job but the first
+		std::condition_variable fetch;
+		bool want = false;
+		bool halt = false;
+		int wake[2] = {-1, -1};
+		std::thread fetcher;
+		if(js && pipe(wake) == 0){
+			fetcher = std::thread([&](){
+				std::unique_lock<std::mutex> lock(mtx);
+				while(true){
+					fetch.wait(lock, [&](){ return halt || want; });
+					if(halt)
+						return;
+
+					lock.unlock();
+					char token;
+					bool got = js->take(token);
+					bool gone = !got && js->wait(wake[0]);
+					lock.lock();
+
+					if(got){
+						spare.push_back(token);
+						cv.notify_one();
+					} else if(gone){
+						return;
+					}
+				}
+			});
+		}
+
+		while((!stopping && !ready.empty()) || running > 0){
+			std::size_t slots = jobs;
+			double avg;
+			if(load > 0 && getloadavg(&avg, 1) == 1){
+				std::size_t room = avg < load ? static_cast<std::size_t>(load - avg) : 0;
+				slots = std::max<std::size_t>(std::min(jobs, running + room), 1);
+			}
+
+			while(!stopping && running < slots && !ready.empty()){
+				std::size_t ix = ready.top();
+				if(!fits(ix)){
+					ready.pop();
+					blocked.push_back(ix);
+					continue;
+				}
+
+				if(js && running > 0){
+					std::lock_guard<std::mutex> lock(mtx);
+					if(spare.empty())
+						break;
+					held.push_back(spare.back());
+					spare.pop_back();
+				}
+
+				ready.pop();
+				running++;
+				if(ix < needs.size()){
+					pooled[needs[ix].pool]++;
+					used += needs[ix].memory;
+				}
+
+				start(ix, [&, ix](int status){
+					std::lock_guard<std::mutex> lock(mtx);
+					done.emplace_back(ix, status);
+					cv.notify_one();
+				});
+			}
+
+			std::unique_lock<std::mutex> lock(mtx);
+			if(fetcher.joinable()){
+				bool need = !stopping && running < slots && !ready.empty();
+				if(need != want){
+					want = need;
+					fetch.notify_one();
+				}
+
+				// Tokens nobody waits for go back right away
+				if(!need){
+					for(char token: spare)
+						js->give(token);
+					spare.clear();
+				}
+			}
+			cv.wait(lock, [&](){ return !done.empty() || (want && !spare.empty()); });
+
+			for(const auto& [ix, status]: done){
+				running--;
+				finished++;
+				if(ix < needs.size()){
+					pooled[needs[ix].pool]--;
+					used -= needs[ix].memory;
+				}
+
+				if(held.size() > (running ? running - 1 : 0)){
+					spare.push_back(held.back());
+					held.pop_back();
+				}
+
+				if(status){
+					if(!ret)
+						ret = status;
+					if(keepGoing && ++failed >= keepGoing)
+						stopping = true;
+					continue;
+				}
+
+				if(ix < consumers.size()) for(std::size_t next: consumers[ix]){
+					if(--pending[next] == 0)
+						ready.push(next);
+				}
+			}
+			done.clear();
+
+			// Finished jobs may have made room for them
+			for(std::size_t ix: blocked)
+				ready.push(ix);
+			blocked.clear();
+
+			if(stopping && !terminated && running > 0){
+				terminated = true;
+				log.error("Build failed, terminating {} running commands", running);
+				Reaper::instance().terminate();
+			}
+		}
+
+		if(fetcher.joinable()){
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				halt = true;
+			}
+			fetch.notify_one();
+			char c = 0;
+			while(write(wake[1], &c, 1) < 0 && errno == EINTR);
+			fetcher.join();
+		}
+		if(wake[0] >= 0){
+			close(wake[0]);
+			close(wake[1]);
+		}
+		if(js){
+			for(char token: spare)
+				js->give(token);
+		}
+
+		if(!ret && finished < count){
+			log.error("Dependency cycle between {} commands", count - finished);
+			return 1;
+		}
+
+		return ret;
+	}
+
+	int Scheduler::run(Log& log, const std::vector<std::unique_ptr<Runnable>>& cmds) const {
+		return run(log, cmds.size(), [&](std::size_t ix, std::function<void(int)> done){
+			cmds[ix]->start(log, std::move(done));
+		});
+	}
+
+	int CmdPoolAsync::wait(){
+		// Status of the first failed command, all of them are waited for
+		int ret = 0;
+		for(auto& cmd: *this){
+			int status = cmd.get();
+			if(!ret)
+				ret = status;
+		}
+		return ret;
+	}
+
+	int CmdPool::sync(Log& log) const {
+		int ret = 0;
+		for(auto& cmd: *this){
+			ret = cmd->sync(log);
+			if(ret) return ret;
+		}
+		return 0;
+	}
+
+	CmdPoolAsync CmdPool::async(Log& log) const {
+		CmdPoolAsync pool;
+		for(const auto& cmd: *this){
+			pool.emplace_back(cmd->async(log));
+		}
+		return pool;
+	}
+
+	int CmdQueue::sync(Log& log) const {
+		int ret = 0;
+		for(auto& cmd: *this){
+			ret = cmd->sync(log);
+			if(ret) return ret;
+		}
+		return 0;
+	}
+
+	void CmdQueue::_next(Log& log, std::size_t ix, std::function<void(int)> done) const {
+		if(ix >= size())
+			return done(0);
+
+		(*this)[ix]->start(log, [this, &log, ix, done](int status){
+			if(status)
+				done(status);
+			else
+				_next(log, ix + 1, done);
+		});
+	}
+
+	std::uint32_t Database::_id(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path p){
+		auto [it, added] = ids.emplace(p, static_cast<std::uint32_t>(ids.size()));
+		if(added){
+			const std::string& str = p.str();
+			_write(out, PATH);
+			_write(out, static_cast<std::uint32_t>(str.size()));
+			out.write(str.data(), str.size());
+		}
+		return it->second;
+	}
+
+	void Database::_write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path output, const Record& rec){
+		std::uint32_t output_id = _id(out, ids, output);
+		std::vector<std::uint32_t> deps;
+		for(const auto& dep: rec.deps)
+			deps.push_back(_id(out, ids, dep));
+
+		_write(out, RECORD);
+		_write(out, output_id);
+		_write(out, rec.command);
+		_write(out, rec.inputs);
+		_write(out, rec.output);
+		_write(out, rec.mtime);
+		_write(out, static_cast<std::uint32_t>(deps.size()));
+		out.write(reinterpret_cast<const char*>(deps.data()), deps.size() * sizeof(std::uint32_t));
+	}
+
+	void Database::_write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path file, const FileHash& fh){
+		std::uint32_t id = _id(out, ids, file);
+		_write(out, HASH);
+		_write(out, id);
+		_write(out, fh);
+	}
+
+	void Database::_write(std::ostream& out, std::unordered_map<Path, std::uint32_t, Path::Hasher>& ids, Path output, const Usage& usage){
+		std::uint32_t id = _id(out, ids, output);
+		_write(out, USAGE);
+		_write(out, id);
+		_write(out, usage);
+	}
+
+	bool Database::_load(std::uint64_t& end){
+		std::ifstream in(path, std::ios::binary);
+		if(!in)
+			return false;
+
+		char magic[4];
+		std::uint32_t version;
+		if(!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + 4, MAGIC) || !_read(in, version) || version != VERSION)
+			return false;
+
+		std::vector<Path> paths;
+		char kind;
+		// A truncated last entry (e.g. after a crash) is simply dropped,
+		// open() cuts it off before appending
+		end = in.tellg();
+		for(; _read(in, kind); end = in.tellg()){
+			std::uint32_t id, len;
+			if(kind == PATH){
+				if(!_read(in, len))
+					break;
+
+				std::string p(len, '\0');
+				if(!in.read(p.data(), len))
+					break;
+
+				ids.emplace(p, static_cast<std::uint32_t>(paths.size()));
+				paths.emplace_back(p);
+			} else if(kind == RECORD){
+				Record rec;
+				if(!_read(in, id) || !_read(in, rec.command) || !_read(in, rec.inputs) || !_read(in, rec.output) || !_read(in, rec.mtime) || !_read(in, len) || id >= paths.size())
+					break;
+
+				std::vector<std::uint32_t> deps(len);
+				if(!in.read(reinterpret_cast<char*>(deps.data()), len * sizeof(std::uint32_t)))
+					break;
+
+				bool valid = true;
+				for(std::uint32_t dep: deps){
+					if(dep >= paths.size()){
+						valid = false;
+						break;
+					}
+					rec.deps.push_back(paths[dep]);
+				}
+
+				if(!valid)
+					break;
+
+				if(!records.insert_or_assign(paths[id], std::move(rec)).second)
+					stale++;
+			} else if(kind == HASH){
+				FileHash fh;
+				if(!_read(in, id) || !_read(in, fh) || id >= paths.size())
+					break;
+
+				if(!hashes.insert_or_assign(paths[id], fh).second)
+					stale++;
+			} else if(kind == USAGE){
+				Usage usage;
+				if(!_read(in, id) || !_read(in, usage) || id >= paths.size())
+					break;
+
+				if(!usages.insert_or_assign(paths[id], usage).second)
+					stale++;
+			} else{
+				break;
+			}
+		}
+
+		return true;
+	}
+
+	bool Database::open(Log& log, const std::filesystem::path& p){
+		close();
+
+		path = p;
+		std::uint64_t end = 0;
+		bool loaded = _load(end);
+
+		// Entries appended after garbage would never be read back
+		std::error_code ec;
+		if(loaded && std::filesystem::file_size(path, ec) > end && !ec){
+			std::filesystem::resize_file(path, end, ec);
+			if(ec){
+				log.warning("Failed to truncate build database {}: {}", path, ec.message());
+				loaded = false;
+				records.clear();
+				hashes.clear();
+				usages.clear();
+				stale = 0;
+			}
+		}
+
+		out.open(path, std::ios::binary | (loaded ? std::ios::app : std::ios::trunc));
+		if(!out){
+			log.error("Failed to open build database {}", path);
+			return true;
+		}
+
+		if(!loaded){
+			ids.clear();
+			_header(out);
+		}
+
+		return false;
+	}
+
+	void Database::close(){
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!out.is_open())
+			return;
+
+		out.close();
+
+		if(stale > 1024 && stale > 3 * (records.size() + hashes.size() + usages.size())){
+			std::filesystem::path tmp = path.string() + ".tmp";
+			std::ofstream compact(tmp, std::ios::binary | std::ios::trunc);
+			std::unordered_map<Path, std::uint32_t, Path::Hasher> compact_ids;
+			_header(compact);
+			for(const auto& [output, rec]: records)
+				_write(compact, compact_ids, output, rec);
+			for(const auto& [file, fh]: hashes)
+				_write(compact, compact_ids, file, fh);
+			for(const auto& [output, usage]: usages)
+				_write(compact, compact_ids, output, usage);
+			compact.close();
+
+			std::error_code ec;
+			std::filesystem::rename(tmp, path, ec);
+		}
+
+		records.clear();
+		hashes.clear();
+		usages.clear();
+		ids.clear();
+		stale = 0;
+	}
+
+	bool Database::get(Path output, Record& rec) const {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = records.find(output);
+		if(it == records.end())
+			return false;
+
+		rec = it->second;
+		return true;
+	}
+
+	void Database::put(Path output, const Record& rec){
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!records.insert_or_assign(output, rec).second)
+			stale++;
+
+		if(out.is_open()){
+			_write(out, ids, output, rec);
+			out.flush();
+		}
+	}
+
+	Database::Usage Database::usage(Path output) const {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto it = usages.find(output);
+		return it == usages.end() ? Usage{} : it->second;
+	}
+
+	void Database::putUsage(Path output, const Usage& usage){
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!usages.insert_or_assign(output, usage).second)
+			stale++;
+
+		if(out.is_open())
+			_write(out, ids, output, usage);
+	}
+
+	std::uint64_t Database::contentHash(Path file){
+		Stat st = StatCache::stat(file);
+		if(!st.exists)
+			return 0;
+
+		FileHash fh;
+		fh.ino = st.ino;
+		fh.size = st.size;
+		fh.mtime = st.mtime;
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			auto it = hashes.find(file);
+			if(it != hashes.end() && it->second.same(fh))
+				return it->second.hash;
+		}
+
+		fh.hash = Hash::file(file.str());
+
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!hashes.insert_or_assign(file, fh).second)
+			stale++;
+
+		if(out.is_open()){
+			_write(out, ids, file, fh);
+			out.flush();
+		}
+
+		return fh.hash;
+	}
+
+	std::uint64_t Database::state(std::initializer_list<const std::vector<Path>*> lists){
+		Hash h;
+		for(const auto* files: lists){
+			for(const auto& file: *files){
+				Stat st = StatCache::stat(file);
+				h.update(std::string_view{file.str()});
+				h.update(static_cast<std::uint64_t>(st.exists));
+				if(!st.exists)
+					continue;
+
+				if(content)
+					h.update(contentHash(file));
+				else
+					h.update(static_cast<std::uint64_t>(st.mtime));
+			}
+			h.update(std::string_view{"|"});
+		}
+		return h.digest();
+	}
+
+	std::vector<Path> Database::parseDepfile(const std::filesystem::path& p){
+		std::ifstream in(p);
+		std::stringstream ss;
+		ss << in.rdbuf();
+		const std::string text = ss.str();
+
+		std::vector<Path> deps;
+		std::unordered_set<std::uint32_t> seen;
+		std::string word;
+
+		auto flush = [&](){
+			if(word.empty())
+				return;
+
+			// Rule targets end with a colon
+			Path dep;
+			if(word.back() != ':' && seen.insert((dep = Path(word)).id).second)
+				deps.push_back(dep);
+
+			word.clear();
+		};
+
+		for(std::size_t i = 0; i < text.size(); i++){
+			char c = text[i];
+			if(c == '\\' && i + 1 < text.size()){
+				char n = text[i + 1];
+				if(n == '\n' || n == '\r'){
+					flush();
+					i++;
+					continue;
+				}
+				if(n == ' ' || n == '#' || n == '\\'){
+					word += n;
+					i++;
+					continue;
+				}
+			}
+
+			if(c == '$' && i + 1 < text.size() && text[i + 1] == '$'){
+				word += '$';
+				i++;
+				continue;
+			}
+
+			if(c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+				flush();
+				continue;
+			}
+
+			if(c == ':' && (i + 1 >= text.size() || std::isspace(static_cast<unsigned char>(text[i + 1])))){
+				word += c;
+				flush();
+				continue;
+			}
+
+			word += c;
+		}
+		flush();
+
+		return deps;
+	}
+
+	bool Http::Url::parse(std::string_view url){
+		if(url.substr(0, 7) != "http://")
+			return true;
+
+		url.remove_prefix(7);
+		std::size_t slash = url.find('/');
+		std::string_view authority = url.substr(0, slash);
+		prefix = slash == std::string_view::npos ? "" : std::string{url.substr(slash)};
+		while(!prefix.empty() && prefix.back() == '/')
+			prefix.pop_back();
+
+		std::size_t colon = authority.rfind(':');
+		host = std::string{authority.substr(0, colon)};
+		if(colon != std::string_view::npos)
+			port = std::string{authority.substr(colon + 1)};
+
+		return host.empty();
+	}
+
+	int Http::connect(const Url& url){
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		addrinfo* res = nullptr;
+		if(getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &res))
+			return -1;
+
+		int fd = -1;
+		for(addrinfo* ai = res; ai; ai = ai->ai_next){
+			fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+			if(fd < 0)
+				continue;
+
+			if(::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+
+			::close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+
+		if(fd >= 0){
+			timeval tv{30, 0};
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		}
+
+		return fd;
+	}
+
+	bool Http::send(int fd, const char* data, std::size_t len){
+		while(len){
+			ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	bool Http::sendFile(int fd, const std::filesystem::path& p){
+		std::ifstream in(p, std::ios::binary);
+		char chunk[CHUNK];
+		while(in){
+			in.read(chunk, sizeof(chunk));
+			if(in.gcount() && !send(fd, chunk, in.gcount()))
+				return false;
+		}
+		return in.eof();
+	}
+
+	bool Http::readHead(int fd, Head& head){
+		std::string buf;
+		std::size_t end;
+		char chunk[4096];
+		while((end = buf.find("\r\n\r\n")) == std::string::npos){
+			ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0 || buf.size() > (1 << 16))
+				return false;
+			buf.append(chunk, n);
+		}
+
+		head.rest = buf.substr(end + 4);
+		std::istringstream in(buf.substr(0, end));
+		std::string line;
+		std::getline(in, line);
+
+		std::istringstream first(line);
+		std::string a, b;
+		first >> a >> b;
+		if(starts_with(a, "HTTP/")){
+			head.status = std::atoi(b.c_str());
+		} else{
+			head.method = a;
+			head.target = b;
+		}
+
+		while(std::getline(in, line)){
+			std::size_t colon = line.find(':');
+			if(colon == std::string::npos)
+				continue;
+
+			std::string name = line.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c){ return std::tolower(c); });
+			std::string value = line.substr(colon + 1);
+			std::transform(value.begin(), value.end(), value.begin(), [](unsigned char c){ return std::tolower(c); });
+			if(name == "content-length"){
+				head.length = std::strtoull(value.c_str(), nullptr, 10);
+				head.sized = true;
+			} else if(name == "transfer-encoding" && value.find("chunked") != std::string::npos){
+				head.chunked = true;
+			}
+		}
+
+		return true;
+	}
+
+	bool Http::readBody(int fd, const Head& head, const std::function<bool(const char*, std::size_t)>& sink){
+		std::uint64_t left = head.length;
+		std::size_t first = std::min<std::uint64_t>(left, head.rest.size());
+		if(first && !sink(head.rest.data(), first))
+			return false;
+		left -= first;
+
+		std::vector<char> chunk(CHUNK);
+		while(left){
+			ssize_t n = ::recv(fd, chunk.data(), std::min<std::uint64_t>(left, chunk.size()), 0);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0 || !sink(chunk.data(), n))
+				return false;
+			left -= n;
+		}
+		return true;
+	}
+
+	bool Http::get(const Url& url, const std::string& path, const std::filesystem::path& file){
+		int fd = connect(url);
+		if(fd < 0)
+			return false;
+
+		Head head;
+		bool ok = send(fd, "GET " + url.prefix + path + " HTTP/1.1\r\nHost: " + url.host + "\r\nConnection: close\r\n\r\n")
+			&& readHead(fd, head)
+			&& head.status == 200
+			&& head.sized && !head.chunked;
+
+		if(ok){
+			std::ofstream out(file, std::ios::binary | std::ios::trunc);
+			ok = readBody(fd, head, [&](const char* data, std::size_t len){
+				return static_cast<bool>(out.write(data, len));
+			});
+		}
+
+		::close(fd);
+		return ok;
+	}
+
+	bool Http::put(const Url& url, const std::string& path, const std::filesystem::path& file){
+		std::error_code ec;
+		std::uint64_t size = std::filesystem::file_size(file, ec);
+		if(ec)
+			return false;
+
+		int fd = connect(url);
+		if(fd < 0)
+			return false;
+
+		Head head;
+		bool ok = send(fd, "PUT " + url.prefix + path + " HTTP/1.1\r\nHost: " + url.host + "\r\nContent-Length: " + std::to_string(size) + "\r\nConnection: close\r\n\r\n")
+			&& sendFile(fd, file)
+			&& readHead(fd, head)
+			&& head.status / 100 == 2;
+
+		::close(fd);
+		return ok;
+	}
+
+	std::string Cache::hex(std::uint64_t key){
+		std::stringstream ss;
+		ss << std::hex << std::setw(16) << std::setfill('0') << key;
+		return ss.str();
+	}
+
+	std::uint64_t Cache::_contents(Hash& h, Database& db, const std::vector<Path>& files){
+		for(const auto& file: files){
+			h.update(std::string_view{file.str()});
+			h.update(db.contentHash(file));
+		}
+		return h.digest();
+	}
+
+	std::uint64_t Cache::key(std::uint64_t command, Database& db, const std::vector<Path>& inputs, const std::vector<Path>& dependences) const {
+		Hash h;
+		h.update(command);
+		_contents(h, db, inputs);
+		h.update(std::string_view{"|"});
+		return _contents(h, db, dependences);
+	}
+
+	std::uint64_t Cache::_object(std::uint64_t key, Database& db, const std::vector<Path>& deps) const {
+		Hash h;
+		h.update(key);
+		return _contents(h, db, deps);
+	}
+
+	bool Cache::_clone(const std::filesystem::path& from, const std::filesystem::path& to){
+		std::error_code ec;
+		std::filesystem::remove(to, ec);
+
+#ifdef FICLONE
+		int src = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+		if(src >= 0){
+			struct stat st;
+			int dst = fstat(src, &st) ? -1 : ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+			bool cloned = dst >= 0 && ioctl(dst, FICLONE, src) == 0;
+			if(dst >= 0)
+				::close(dst);
+			::close(src);
+
+			if(cloned)
+				return true;
+
+			std::filesystem::remove(to, ec);
+		}
+#endif
+
+		ec.clear();
+		std::filesystem::create_hard_link(from, to, ec);
+		if(!ec)
+			return true;
+
+		ec.clear();
+		std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+		return !ec;
+	}
+
+	bool Cache::_put(const std::filesystem::path& p, const std::function<bool(const std::filesystem::path&)>& write){
+		std::error_code ec;
+		std::filesystem::create_directories(p.parent_path(), ec);
+
+		static std::atomic<std::uint64_t> counter{0};
+		std::filesystem::path tmp = p.string() + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+		if(!write(tmp)){
+			std::filesystem::remove(tmp, ec);
+			return false;
+		}
+
+		std::filesystem::rename(tmp, p, ec);
+		if(ec)
+			std::filesystem::remove(tmp, ec);
+		return !ec;
+	}
+
+	bool Cache::_readManifest(const std::filesystem::path& p, std::vector<Path>& deps){
+		std::ifstream in(p);
+		if(!in)
+			return false;
+
+		deps.clear();
+		std::string line;
+		while(std::getline(in, line))
+			if(!line.empty())
+				deps.push_back(line);
+		return true;
+	}
+
+	bool Cache::restore(std::uint64_t key, const std::string& output, std::vector<Path>& deps, Database& db) const {
+		if(!local())
+			return false;
+
+		std::filesystem::path manifest = _path('m', key);
+		if(!_readManifest(manifest, deps))
+			return false;
+
+		std::filesystem::path object = _path('o', _object(key, db, deps));
+		if(!std::filesystem::exists(object) || !_clone(object, output))
+			return false;
+
+		_touch(manifest);
+		_touch(object);
+		return true;
+	}
+
+	bool Cache::_writeManifest(const std::filesystem::path& p, const std::vector<Path>& deps){
+		std::ofstream out(p);
+		for(const auto& dep: deps)
+			out << dep << '\n';
+		return static_cast<bool>(out);
+	}
+
+	bool Cache::fetch(std::uint64_t key, const std::string& output, std::vector<Path>& deps, Database& db) const {
+		if(!hasRemote())
+			return false;
+
+		std::filesystem::path manifest = local() ? _path('m', key) : std::filesystem::path(output + ".manifest");
+		bool ok = _put(manifest, [&](const std::filesystem::path& tmp){
+			return Http::get(remote, "/ac/" + hex(key), tmp);
+		}) && _readManifest(manifest, deps);
+
+		if(!local()){
+			std::error_code ec;
+			std::filesystem::remove(manifest, ec);
+		}
+
+		if(!ok)
+			return false;
+
+		std::uint64_t object = _object(key, db, deps);
+		std::filesystem::path target = local() ? _path('o', object) : std::filesystem::path(output);
+		if(!_put(target, [&](const std::filesystem::path& tmp){
+			return Http::get(remote, "/cas/" + hex(object), tmp);
+		}))
+			return false;
+
+		return !local() || _clone(target, output);
+	}
+
+	void Cache::_upload(std::uint64_t key, std::uint64_t object, const std::filesystem::path& file, const std::vector<Path>& deps) const {
+		uploads.post([this, key, object, file, deps](){
+			std::filesystem::path manifest = local() ? _path('m', key) : std::filesystem::path(file.string() + ".manifest");
+			if(!local() && !_writeManifest(manifest, deps))
+				return;
+
+			// The object goes first, so a visible manifest implies the object
+			if(Http::put(remote, "/cas/" + hex(object), file))
+				Http::put(remote, "/ac/" + hex(key), manifest);
+
+			if(!local()){
+				std::error_code ec;
+				std::filesystem::remove(manifest, ec);
+			}
+		});
+	}
+
+	void Cache::wait() const {
+		uploads.wait();
+	}
+
+	void Cache::store(std::uint64_t key, const std::string& output, const std::vector<Path>& deps, Database& db) const {
+		std::uint64_t object = _object(key, db, deps);
+
+		if(local()){
+			_put(_path('o', object), [&](const std::filesystem::path& tmp){
+				return _clone(output, tmp);
+			});
+
+			_put(_path('m', key), [&](const std::filesystem::path& tmp){
+				return _writeManifest(tmp, deps);
+			});
+		}
+
+		if(hasRemote())
+			_upload(key, object, local() ? _path('o', object) : std::filesystem::path(output), deps);
+	}
+
+	void Cache::trim(Log& log) const {
+		if(!local() || !budget || !std::filesystem::exists(dir))
+			return;
+
+		struct Entry{
+			std::int64_t mtime;
+			std::uint64_t size;
+			std::filesystem::path path;
+		};
+
+		std::vector<Entry> entries;
+		std::uint64_t total = 0;
+		for(const auto& e: std::filesystem::recursive_directory_iterator(dir)){
+			if(!e.is_regular_file())
+				continue;
+
+			Stat st = Stat::of(e.path().string());
+			entries.push_back({st.mtime, st.size, e.path()});
+			total += st.size;
+		}
+
+		if(total <= budget)
+			return;
+
+		std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){
+			return a.mtime < b.mtime;
+		});
+
+		std::size_t removed = 0;
+		std::error_code ec;
+		for(const auto& e: entries){
+			if(total <= budget)
+				break;
+
+			if(std::filesystem::remove(e.path, ec)){
+				total -= e.size;
+				removed++;
+			}
+		}
+
+		log.info("Evicted {} cache entries from {}", removed, dir);
+	}
+
+	void CacheServer::_handle(int fd) const {
+		Http::Head head;
+		if(!Http::readHead(fd, head)){
+			::close(fd);
+			return;
+		}
+
+		std::string_view target = head.target;
+		std::size_t slash = target.rfind('/');
+		std::string_view kind = slash == std::string_view::npos ? "" : target.substr(0, slash);
+		std::string_view key = slash == std::string_view::npos ? "" : target.substr(slash + 1);
+
+		if((kind != "/ac" && kind != "/cas") || !_valid(key)){
+			Http::respond(fd, 400, "Bad Request");
+			::close(fd);
+			return;
+		}
+
+		std::filesystem::path file = dir / std::string{kind.substr(1)} / std::string{key.substr(0, 2)} / std::string{key};
+
+		if(head.method == "GET"){
+			std::error_code ec;
+			std::uint64_t size = std::filesystem::file_size(file, ec);
+			if(ec)
+				Http::respond(fd, 404, "Not Found");
+			else if(Http::respond(fd, 200, "OK", size))
+				Http::sendFile(fd, file);
+		} else if(head.method == "PUT" && (!head.sized || head.chunked)){
+			Http::respond(fd, 411, "Length Required");
+		} else if(head.method == "PUT"){
+			bool ok = Cache::_put(file, [&](const std::filesystem::path& tmp){
+				std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+				return Http::readBody(fd, head, [&](const char* data, std::size_t len){
+					return static_cast<bool>(out.write(data, len));
+				}) && out.flush();
+			});
+
+			if(ok)
+				Http::respond(fd, 201, "Created");
+			else
+				Http::respond(fd, 500, "Internal Server Error");
+		} else{
+			Http::respond(fd, 405, "Method Not Allowed");
+		}
+
+		::close(fd);
+	}
+
+	int CacheServer::serve(Log& log) const {
+		addrinfo hints{};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		addrinfo* res = nullptr;
+		if(int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res)){
+			log.error("Failed to resolve {}: {}", host, gai_strerror(err));
+			return 1;
+		}
+
+		int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+		int one = 1;
+		if(fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if(fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 64)){
+			log.error("Failed to listen on {}:{}: {}", host, port, std::strerror(errno));
+			freeaddrinfo(res);
+			if(fd >= 0)
+				::close(fd);
+			return 1;
+		}
+		freeaddrinfo(res);
+
+		log.info("Serving cache {} on http://{}:{}", dir, host, port);
+
+		while(true){
+			int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if(client < 0){
+				if(errno == EINTR || errno == ECONNABORTED)
+					continue;
+
+				log.error("Failed to accept: {}", std::strerror(errno));
+				::close(fd);
+				return 1;
+			}
+
+			std::thread([this, client](){
+				_handle(client);
+			}).detach();
+		}
+	}
+
+	Cmd CmdEntry::compile() const {
+		Scope local({
+			{"in", {inputs.begin(), inputs.end()}},
+			{"out", {output}}
+		}, scope);
+
+		if(depfile.empty())
+			return cmd.compile(local);
+
+		local.vars["depfile"] = {depfile};
+
+		Cmd c = cmd.compile(local);
+		if(!cmd.uses("depfile"))
+			c.cmd.insert(c.cmd.end(), {"-MMD", "-MF", depfile});
+
+		return c;
+	}
+
+	void CmdEntry::_restat(Database::Record& rec) const {
+		rec.output = Hash::file(output.str());
+		rec.mtime = File(output.str()).time;
+
+		Database::Record old;
+		if(!db->get(output, old) || !old.mtime || old.output != rec.output || old.mtime == rec.mtime)
+			return;
+
+		timespec times[2];
+		times[0].tv_sec = 0;
+		times[0].tv_nsec = UTIME_OMIT;
+		times[1].tv_sec = old.mtime / 1000000000;
+		times[1].tv_nsec = old.mtime % 1000000000;
+		if(utimensat(AT_FDCWD, output.c_str(), times, 0) == 0){
+			rec.mtime = old.mtime;
+			StatCache::invalidate(output);
+		}
+	}
+
+	std::uint64_t CmdEntry::_cacheKey(const Cmd& c, const Database::Record& rec) const {
+		if(!cacheable || depfile.empty() || !db || !cache || !cache->enabled())
+			return 0;
+
+		std::uint64_t command = Hash{}.update(rec.command).update(db->contentHash(c.program())).digest();
+		return cache->key(command, *db, inputs, dependences);
+	}
+
+	bool CmdEntry::_restore(Log& log, std::uint64_t key, const Database::Record& rec, bool remote) const {
+		std::vector<Path> deps;
+		if(!key || !(remote ? cache->fetch(key, output, deps, *db) : cache->restore(key, output, deps, *db)))
+			return false;
+
+		log.info("Restored from {}cache: {}", remote ? "remote " : "", output);
+		_finish(rec, 0, &deps);
+		return true;
+	}
+
+	void CmdEntry::_finish(Database::Record rec, std::uint64_t key, const std::vector<Path>* cached) const {
+		StatCache::invalidate(output);
+
+		if(db && (restat || cmd.restat))
+			_restat(rec);
+
+		if(cached){
+			rec.deps = *cached;
+		} else if(!depfile.empty()){
+			rec.deps = Database::parseDepfile(depfile);
+			std::error_code ec;
+			std::filesystem::remove(depfile, ec);
+		}
+
+		if(key)
+			cache->store(key, output, rec.deps, *db);
+
+		rec.inputs = _state(rec.inputs, rec.deps);
+
+		if(db)
+			db->put(output, rec);
+	}
+
+	bool CmdEntry::smartRun(const Database::Record& rec) const {
+		if(smart){
+			File o(output.str());
+			if(!o.exists)
+				return true;
+
+			if(db){
+				Database::Record old;
+				if(!db->get(output, old))
+					return true;
+
+				return old.command != rec.command || old.inputs != _state(rec.inputs, old.deps);
+			}
+			
+			bool run = false;
+			for(const auto& i: inputs){
+				File f(i.str());
+				if(f > o){
+					run = true;
+					break;
+				}
+			}
+
+			if(!run) for(const auto& d: dependences){
+				File f(d.str());
+				if(f > o){
+					run = true;
+					break;
+				}
+			}
+
+			return run;
+		}
+
+		return true;
+	}
+
+	int CmdEntry::sync(Log& log) const {
+		directory().make(log);
+
+		Cmd c = compile();
+		Database::Record rec = record(c);
+		
+		if(!smartRun(rec))
+			return 0;
+
+		std::uint64_t key = _cacheKey(c, rec);
+		if(_restore(log, key, rec) || _restore(log, key, rec, true))
+			return 0;
+
+		if(key)
+			_unlink();
+
+		auto begin = std::chrono::steady_clock::now();
+		Exit e = c.exec(log);
+		int ret = e.status();
+		if(ret){
+			StatCache::invalidate(output);
+		} else{
+			_usage(begin, e);
+			_finish(std::move(rec), key);
+		}
+
+		return ret;
+	}
+
+	void CmdEntry::launch(Log& log, std::function<void(const Exit* e)> done, std::function<void()> step) const {
+		// Checks stat and hash inputs and restore from the cache, so they
+		// run on the workers and leave the scheduler to start commands
+		Workers::instance().post([this, &log, done, step](){
+			directory().make(log);
+
+			Cmd c = compile();
+			Database::Record rec = record(c);
+
+			if(!smartRun(rec))
+				return done(nullptr);
+
+			std::uint64_t key = _cacheKey(c, rec);
+			if(_restore(log, key, rec) || _restore(log, key, rec, true))
+				return done(nullptr);
+
+			if(key)
+				_unlink();
+
+			if(step)
+				step();
+
+			auto begin = std::chrono::steady_clock::now();
+			c.launch(log, [this, rec, key, done, step, begin](const Exit& e){
+				if(step)
+					step();
+
+				if(!e.ok()){
+					StatCache::invalidate(output);
+					return done(&e);
+				}
+
+				// Hashing outputs, parsing the depfile and storing in the cache
+				// would hold up the reaper and with it every other command
+				auto end = std::chrono::steady_clock::now();
+				Workers::instance().post([this, rec, key, done, begin, end, e](){
+					_usage(begin, e, end);
+					_finish(rec, key);
+					done(&e);
+				});
+			});
+		});
+	}
+
+	std::string CmdEntry::ninja() const {
+		std::stringstream ss;
+		ss << "build " << output << ": " << cmd.name;
+
+		for(const auto& in: inputs)
+			ss << " " << in;
+
+		if(dependences.size() > 0){
+			ss << " |";
+			for(const auto& dep: dependences)
+				ss << " " << dep;
+		}
+
+		// Only what the rule refers to, in and out are ninja's own
+		std::unordered_set<std::string> used = cmd.variables();
+		std::vector<std::string> vars(used.begin(), used.end());
+		std::sort(vars.begin(), vars.end());
+		for(const auto& name: vars){
+			const std::vector<std::string>* values = scope ? scope->find(name) : nullptr;
+			if(name == "in" || name == "out" || name == "depfile" || !values)
+				continue;
+
+			ss << std::endl << "    " << name << " =";
+			for(const auto& value: *values)
+				ss << " " << value;
 		}
 
-		inline bool applyMod(std::size_t stage, std::size_t mod){
-			if(stage >= stages.size() || mod >= mods.size())
-				return true;
+		if(restat || cmd.restat)
+			ss << std::endl << "    restat = 1";
 
-			mods4stage[stage].insert(mod);
-			return false;
+		if(!pool.empty())
+			ss << std::endl << "    pool = " << pool;
+
+		if(!depfile.empty()){
+			ss << std::endl << "    depfile = " << depfile;
+			ss << std::endl << "    deps = gcc";
+			if(!cmd.uses("depfile"))
+				ss << std::endl << "    depflags = -MMD -MF " << depfile;
 		}
+		
+		return ss.str();
+	}
 
-		inline int build(){
-			std::filesystem::create_directory(flags["build"]);
+	std::string CmdEntry::make() const {
+		std::stringstream ss;
+		ss << output << ":";
 
-			int ret = 0;
+		for(const auto& in: inputs)
+			ss << " " << in;
 
-			std::unordered_map<std::string, std::vector<std::string>> flgs;
-			for(auto [k, v]: flags){
-				flgs[std::string{k}] = {std::string{v}};
-			}
+		for(const auto& dep: dependences)
+			ss << " " << dep;
 
-			std::vector<Module> mods = this->mods;
+		ss << std::endl << "\t";
 
-			CmdPool pool;
-			for(const auto& stage: stages){
-				for(std::size_t mod_ix: mods4stage[stages.dict[stage->name]]){
-					Module& mod = mods[mod_ix];
-					if(!mod.disabled) for(auto& cmd: stage->apply(mod, flgs)){
-						cmd.smart = true;
-						pool.push(cmd);
-					}
+		ss << compile().str() << std::endl;
+
+		return ss.str();
+	}
+
+	void Graph::connect(){
+		// Indexed by path id, nodes.size() where no node produces the path and
+		// the first node wins where several do
+		std::vector<std::size_t> producers(Path::count(), nodes.size());
+		for(std::size_t i = nodes.size(); i-- > 0;)
+			producers[nodes[i].output.id] = i;
+
+		consumers.assign(nodes.size(), {});
+		for(std::size_t i = 0; i < nodes.size(); i++){
+			for(const auto* files: {&nodes[i].inputs, &nodes[i].dependences}){
+				for(const auto& file: *files){
+					std::size_t producer = producers[file.id];
+					if(producer != nodes.size() && producer != i)
+						consumers[producer].push_back(i);
 				}
+			}
+		}
+	}
+
+	void Trace::add(std::string_view name, std::string_view cat, std::int64_t ts, std::size_t tid, std::string args, std::int64_t end){
+		if(!enabled)
+			return;
+
+		if(end < 0)
+			end = now();
+		std::lock_guard<std::mutex> lock(mtx);
+		events.push_back(Event{std::string(name), std::string(cat), ts, end - ts, tid, std::move(args)});
+	}
 
-				if((ret = pool.async(log).wait()))
-					return ret;
+	bool Trace::write(Log& log, const std::filesystem::path& p){
+		std::ofstream out(p);
+		if(!out){
+			log.error("Failed to write trace {}", p);
+			return true;
+		}
+
+		std::lock_guard<std::mutex> lock(mtx);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		for(std::size_t i = 0; i < events.size(); i++){
+			const Event& e = events[i];
+			out << (i ? ",\n" : "\n");
+			out << "{\"name\":\"" << _escape(e.name) << "\",\"cat\":\"" << _escape(e.cat) << "\",\"ph\":\"X\"";
+			out << ",\"ts\":" << e.ts << ",\"dur\":" << e.dur << ",\"pid\":" << getpid() << ",\"tid\":" << e.tid;
+			out << ",\"args\":{" << e.args << "}}";
+		}
+		out << "\n]}\n";
+
+		return !out;
+	}
+
+	std::string Trace::_escape(std::string_view str){
+		std::string ret;
+		ret.reserve(str.size());
+		for(char c: str){
+			if(c == '"' || c == '\\'){
+				ret += '\\';
+				ret += c;
+			} else if(static_cast<unsigned char>(c) < 0x20){
+				char buf[8];
+				std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+				ret += buf;
+			} else{
+				ret += c;
+			}
+		}
+		return ret;
+	}
 
-				pool.clear();
+	std::vector<std::uint64_t> Graph::priorities() const {
+		std::size_t n = nodes.size();
+		std::vector<std::uint64_t> cost(n, 0);
+		std::vector<std::uint64_t> bytes(n, 0);
+		std::uint64_t timed_ms = 0;
+		std::uint64_t timed_bytes = 0;
+		for(std::size_t i = 0; i < n; i++){
+			for(const auto& in: nodes[i].inputs)
+				bytes[i] += StatCache::stat(in).size;
+
+			cost[i] = nodes[i].db ? nodes[i].db->usage(nodes[i].output).ms : 0;
+			if(cost[i]){
+				timed_ms += cost[i];
+				timed_bytes += bytes[i];
 			}
+		}
 
-			return ret;
+		for(std::size_t i = 0; i < n; i++){
+			if(cost[i])
+				continue;
+
+			// Without any timed node sizes alone decide the order
+			cost[i] = timed_ms && timed_bytes ? bytes[i] * timed_ms / timed_bytes : bytes[i];
+			cost[i]++;
 		}
 
-		inline int run(){
-			bool dflt = false;
-			for(const auto& [name, mod]: mods.dict){
-				if(isFlagSet(name)){
-					dflt = true;
-					break;
+		// Topological order, nodes on cycles are left out and keep their cost
+		std::vector<std::size_t> pending(n, 0);
+		for(const auto& edges: consumers)
+			for(std::size_t next: edges)
+				pending[next]++;
+
+		std::vector<std::size_t> order;
+		order.reserve(n);
+		for(std::size_t i = 0; i < n; i++)
+			if(pending[i] == 0)
+				order.push_back(i);
+
+		for(std::size_t i = 0; i < order.size(); i++){
+			std::size_t ix = order[i];
+			if(ix < consumers.size()) for(std::size_t next: consumers[ix])
+				if(--pending[next] == 0)
+					order.push_back(next);
+		}
+
+		std::vector<std::uint64_t> ret = cost;
+		for(auto it = order.rbegin(); it != order.rend(); it++){
+			std::uint64_t tail = 0;
+			if(*it < consumers.size()) for(std::size_t next: consumers[*it])
+				tail = std::max(tail, ret[next]);
+			ret[*it] += tail;
+		}
+
+		return ret;
+	}
+
+	int Graph::run(Log& log, const Scheduler& sched, const std::function<bool(std::size_t)>& skip, Trace* trace) const {
+		std::vector<Scheduler::Need> needs(nodes.size());
+		std::unordered_set<std::string> unknown;
+		for(std::size_t i = 0; i < nodes.size(); i++){
+			const CmdEntry& node = nodes[i];
+			if(!node.pool.empty()){
+				auto pool = sched.pools.find(node.pool);
+				if(pool != sched.pools.end())
+					needs[i].pool = pool - sched.pools.begin() + 1;
+				else if(unknown.insert(node.pool).second)
+					log.warning("Unknown pool {}, its commands are not limited", node.pool);
+			}
+
+			if(sched.memory && node.db)
+				needs[i].memory = node.db->usage(node.output).rss;
+		}
+
+		if(!trace || !trace->enabled){
+			return sched.run(log, nodes.size(), [&](std::size_t ix, std::function<void(int)> done){
+				if(skip && skip(ix))
+					return done(0);
+				nodes[ix].start(log, std::move(done));
+			}, consumers, priorities(), needs);
+		}
+
+		// Slots are numbered from 1, the lowest free one is reused
+		std::mutex mtx;
+		std::vector<bool> busy;
+		// When every node started and its command was spawned and exited,
+		// -1 until then. A node's steps follow each other, no lock needed.
+		std::vector<std::array<std::int64_t, 3>> times(nodes.size(), {-1, -1, -1});
+		return sched.run(log, nodes.size(), [&](std::size_t ix, std::function<void(int)> done){
+			if(skip && skip(ix))
+				return done(0);
+
+			std::size_t slot;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				slot = std::find(busy.begin(), busy.end(), false) - busy.begin();
+				if(slot == busy.size())
+					busy.push_back(true);
+				busy[slot] = true;
+			}
+
+			times[ix][0] = trace->now();
+			nodes[ix].launch(log, [&, ix, slot, done](const Exit* e){
+				{
+					std::lock_guard<std::mutex> lock(mtx);
+					busy[slot] = false;
+				}
+
+				// Freshness checks and cache lookups, then the command itself
+				// and at last recording its outputs
+				const auto& [begin, spawned, exited] = times[ix];
+				const CmdEntry& node = nodes[ix];
+				std::string output = "\"output\":\"" + Trace::_escape(node.output.str()) + "\"";
+				trace->add("check", "check", begin, slot + 1, output, spawned);
+				if(e){
+					std::stringstream args;
+					args << output;
+					if(stages[ix] < stageNames.size())
+						args << ",\"stage\":\"" << Trace::_escape(stageNames[stages[ix]]) << "\"";
+					if(modules[ix] < moduleNames.size())
+						args << ",\"module\":\"" << Trace::_escape(moduleNames[modules[ix]]) << "\"";
+					args << ",\"exit\":" << e->status();
+					args << ",\"utime_us\":" << e->usage.ru_utime.tv_sec * 1000000 + e->usage.ru_utime.tv_usec;
+					args << ",\"stime_us\":" << e->usage.ru_stime.tv_sec * 1000000 + e->usage.ru_stime.tv_usec;
+					args << ",\"maxrss\":" << e->maxrss();
+					trace->add(node.cmd.name, "cmd", spawned, slot + 1, args.str(), exited);
+					if(e->ok())
+						trace->add("finish", "finish", exited, slot + 1, output);
+				}
+
+				done(e ? e->status() : 0);
+			}, [&, ix](){
+				auto& t = times[ix];
+				(t[1] < 0 ? t[1] : t[2]) = trace->now();
+			});
+		}, consumers, priorities(), needs);
+	}
+
+	bool Module::addFile(const File& file){
+		if(!file.exists)
+			return true;
+
+		files.emplace_back(file);
+		
+		return false;
+	}
+
+	bool Module::addDirectory(const Directory& dir){
+		if(!dir.exists)
+			return true;
+
+		for(const auto& file: dir.files())
+			files.emplace_back(file);
+
+		return false;
+	}
+
+	std::vector<CmdEntry> Stage::apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags) const {
+		(void) mod;
+		(void) produced;
+		(void) flags;
+		return {};
+	}
+
+	void Stage::hash(Hash& h) const {
+		h.update(name);
+		h.update(static_cast<std::uint64_t>(restat));
+		h.update(pool);
+
+		// Unordered containers are summed up so their order does not matter
+		std::uint64_t sum = 0;
+		for(const auto& [var, values]: vars){
+			Hash v;
+			v.update(var);
+			for(const auto& value: values)
+				v.update(value);
+			sum += v.digest();
+		}
+		h.update(sum);
+
+		sum = 0;
+		for(const auto& [ext, ix]: cmds.dict){
+			const CmdTmpl& tmpl = cmds[ix];
+			Hash c;
+			c.update(ext).update(tmpl.name).update(static_cast<std::uint64_t>(tmpl.shell)).update(static_cast<std::uint64_t>(tmpl.restat)).update(tmpl.pool);
+			for(const auto& arg: tmpl.cmd)
+				c.update(arg);
+			sum += c.digest();
+		}
+		h.update(sum);
+	}
+
+	std::vector<CmdEntry> Transform::apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags) const {
+		if(cmds.size() <= 0)
+			return {};
+
+		std::shared_ptr<const Scope> vars = mod.scope(scope(std::move(flags)));
+
+		std::vector<CmdEntry> ret;
+		for(const auto* files: {&mod.files, &produced}){
+			for(const auto& file: *files){
+				auto cmd = cmds.find(file.extension());
+				if(cmd == cmds.end())
+					continue;
+
+				std::string out = file.str();
+				if(bro::starts_with(out, "build/")){
+					out = out.substr(out.find('/', 6)); // Cut build/$stage_name/
+					out = out.substr(out.find('/')); // Cut $mod_name/
+				}
+				out = "build/" + name + "/" + mod.name + "/" + out + outext;
+
+				// Without a depfile the headers are unknown, so is a cache hit
+				CmdEntry& entry = ret.emplace_back(out, std::vector<Path>{file}, *cmd, vars);
+				if(depfile){
+					entry.depfile = out + ".d";
+					entry.cacheable = true;
 				}
 			}
+		}
 
-			for(Module& mod: mods)
-				mod.disabled = !isFlagSet(mod.name, !dflt);
+		return ret;
+	}
 
-			// TODO: ninja
-			// TODO: make[file]
+	void Transform::hash(Hash& h) const {
+		Stage::hash(h);
+		h.update(outext).update(static_cast<std::uint64_t>(depfile));
+	}
 
-			if(isFlagSet("clean", false))
-				// TODO: Add removing to API with Log
-				std::filesystem::remove_all(getFlag("build"));
+	std::vector<CmdEntry> Link::apply(const Module& mod, const std::vector<Path>& produced, std::shared_ptr<const Scope> flags) const {
+		if(cmds.size() <= 0)
+			return {};
 
-			return build();
+		CmdEntry ret;
+		ret.output = "build/" + name + "/" + outtmpl.resolve({{"mod", {mod.name}}})[0];
+		ret.dependences = mod.deps;
+		
+		for(const auto* files: {&mod.files, &produced}){
+			for(const auto& file: *files){
+				if(cmds.find(file.extension()) == cmds.end())
+					continue;
+				ret.inputs.emplace_back(file);
+			}
 		}
 
-		inline int ninja(std::ostream& out){
-			for(const CmdTmpl& tmpl: cmds){
-				std::unordered_set<std::string> vars = tmpl.variables();
-				std::unordered_map<std::string, std::vector<std::string>> dict;
-				for(const auto& var: vars){
-					dict[var] = {"$" + var};
+		ret.cmd = *cmds.begin();
+		ret.pool = ret.cmd.pool;
+		ret.scope = mod.scope(scope(std::move(flags)));
+
+		return {ret};
+	}
+
+	void Link::hash(Hash& h) const {
+		Stage::hash(h);
+		h.update(outtmpl);
+	}
+
+	void Bro::_setup_default(){
+		std::string header_path = __FILE__;
+		header = File(header_path);
+		flags["cc"] = C_COMPILER_NAME;
+		flags["cxx"] = CXX_COMPILER_NAME;
+		flags["ld"] = C_COMPILER_NAME;
+		flags["ar"] = "ar"; // TODO DELETE?
+		flags["build"] = "build";
+	}
+
+	Bro::Bro(int argc, const char** argv, std::filesystem::path src):
+		src{src},
+		exe{argv[0]},
+		args{argv, argv + argc}
+	{
+		_setup_default();
+
+		for(int i = 1; i < argc; i++){
+			std::string arg = argv[i];
+			auto eq = arg.find('=');
+			if(starts_with(arg, "-j") && (arg.size() > 2 || i + 1 < argc)){
+				// -jN and -j N are aliases of jobs=N
+				std::string value = arg.size() > 2 ? arg.substr(2) : std::string{argv[i + 1]};
+				if(value.find_first_not_of("0123456789") == std::string::npos){
+					flags["jobs"] = value;
+					if(arg.size() == 2)
+						i++;
+					continue;
 				}
+			}
 
-				out << "rule " << tmpl.name << std::endl;
-				out << "  command = " << tmpl.compile(dict).str() << std::endl;
-				out << std::endl;
+			if(eq != std::string_view::npos){
+				std::string name = arg.substr(0, eq);
+				std::string value = arg.substr(eq + 1);
+				flags[name] = value;
+			} else if(arg[0] == '-'){
+				std::string name = arg.substr(1, -1);
+				flags[name] = "no";
+			} else {
+				flags[arg] = "yes";
 			}
+		}
 
-			std::vector<Module> mods = this->mods;
+		log.quiet = isFlagSet("quiet");
+		log.capture = isFlagSet("capture", true);
+		trace.enabled = isFlagSet("trace");
+	}
 
-			// TODO: Phony targets
-			for(const auto& stage: stages){
-				for(std::size_t mod_ix: mods4stage[stages.dict[stage->name]]){
-					Module& mod = mods[mod_ix];
-					for(const CmdEntry& cmd: stage->apply(mod)){
-						out << cmd.ninja() << std::endl;
-					}
+	std::string Bro::_readStamp(const std::filesystem::path& p){
+		std::ifstream in(p);
+		std::string stamp;
+		std::getline(in, stamp);
+		return stamp;
+	}
+
+	bool Bro::isFresh(){
+		if(hasFlag("~FRESH"))
+			return isFlagSet("~FRESH");
+
+		if(!exe.exists)
+			return true;
+
+		std::string hash = _sourceHash();
+
+		// Set by fresh() for the executable it has just built
+		const char* env = std::getenv("BRO_FRESH");
+		if(env && hash == env)
+			return true;
+
+		std::string stamp = _readStamp(_stamp());
+		if(stamp.empty()){
+			bool fresh = !(src > exe || header > exe);
+			if(fresh)
+				_writeStamp(_stamp(), hash);
+			return fresh;
+		}
+
+		return stamp == hash;
+	}
+
+	std::vector<String> Bro::_pch(const std::vector<String>& defines){
+		const std::string& cxx = flags["cxx"];
+		bool clang = cxx.find("clang") != std::string::npos;
+		std::string out = header.string() + (clang ? ".pch" : ".gch");
+		Hash h;
+		h.update(cxx).update(header.hash());
+		for(const auto& define: defines)
+			h.update(define);
+		std::string hash = Cache::hex(h.digest());
+
+		if(!std::filesystem::exists(out) || _readStamp(out + ".fresh") != hash){
+			Cmd pch({String(cxx)});
+			pch.cmd.insert(pch.cmd.end(), defines.begin(), defines.end());
+			// As in _impl(), the header itself as the main file would warn about #pragma once
+			pch.cmd.insert(pch.cmd.end(), {"-x", "c++-header", "/dev/null", "-include", header.path(), "-o", out});
+			if(pch.sync(log)){
+				log.warning("Failed to precompile {}", header.path());
+				return {};
+			}
+			_writeStamp(out + ".fresh", hash);
+		}
+
+		// GCC picks up bro.hpp.gch next to the header by itself
+		if(clang)
+			return {"-include-pch", out};
+		return {"-Winvalid-pch"};
+	}
+
+	std::string Bro::_impl(){
+		const std::string& cxx = flags["cxx"];
+		std::string out = exe.string() + ".impl.o";
+		std::string hash = Cache::hex(Hash{}.update(cxx).update(header.hash()).digest());
+
+		if(!std::filesystem::exists(out) || _readStamp(out + ".fresh") != hash){
+			// Pulled in by -include, a header compiled as the main file warns about #pragma once
+			Cmd impl({String(cxx), "-DBRO_IMPLEMENTATION", "-x", "c++", "-c", "/dev/null", "-include", header.path(), "-o", out});
+			if(impl.sync(log)){
+				log.warning("Failed to compile the implementation of {}", header.path());
+				return {};
+			}
+			_writeStamp(out + ".fresh", hash);
+		}
+
+		return out;
+	}
+
+	void Bro::fresh(){
+		{
+			Trace::Span span(trace, "freshness check");
+			if(isFresh())
+				return;
+		}
+
+		int ret = 0;
+		std::string hash = _sourceHash();
+		std::string old = exe.string() + ".old";
+
+		// Save exe to .old
+		ret = exe.copy(log, old);
+		if(ret) std::exit(ret);
+		
+		// Recompile, the source defines BRO_IMPLEMENTATION itself and the
+		// precompiled header has to agree with it
+		std::vector<String> defines = {"-DBRO_IMPLEMENTATION="};
+		std::string impl;
+		if(isFlagSet("impl", false) && !(impl = _impl()).empty())
+			defines.push_back("-DBRO_NO_IMPLEMENTATION");
+
+		Cmd cmd({String(flags["cxx"])});
+		if(isFlagSet("pch", false)){
+			std::vector<String> pch = _pch(defines);
+			cmd.cmd.insert(cmd.cmd.end(), pch.begin(), pch.end());
+		}
+		cmd.cmd.insert(cmd.cmd.end(), defines.begin(), defines.end());
+		cmd.cmd.insert(cmd.cmd.end(), {"-o", exe.path(), src.path()});
+		if(!impl.empty())
+			cmd.cmd.push_back(impl);
+
+		if((ret = cmd.sync(log))){
+			log.error("Failed to recompile source: {}", src);
+			std::exit(ret);
+		}
+
+		_writeStamp(_stamp(), hash);
+		setenv("BRO_FRESH", hash.c_str(), 1);
+
+		// Run
+		std::vector<std::string> argv = args.empty() ? std::vector<std::string>{exe.string()} : args;
+		std::vector<char*> ptrs;
+		for(auto& arg: argv)
+			ptrs.push_back(arg.data());
+		ptrs.push_back(nullptr);
+
+		log.flush();
+		execv(exe.c_str(), ptrs.data());
+
+		log.error("Failed to execute {}: {}", exe.path(), std::strerror(errno));
+		std::exit(127);
+	}
+
+	std::string Bro::getFlag(std::string_view name, std::string_view dflt) const {
+		auto flag = flags.find(name);
+		return std::string(flag == flags.end() ? dflt : flag->second);
+	}
+
+	bool Bro::setFlag(std::string_view name, std::string_view value, bool force){
+		auto [flag, added] = flags.try_emplace(name);
+		if(!force && !added)
+			return false;
+
+		flag->second = value;
+		return true;
+	}
+
+	bool Bro::isFlagSet(std::string_view name, bool dflt) const {
+		auto flag = flags.find(name);
+		if(flag == flags.end())
+			return dflt;
+
+		return flag->second != "no" && flag->second != "0";
+	}
+
+	std::uint64_t Bro::getBytes(std::string_view name, std::uint64_t dflt) const {
+		auto flag = flags.find(name);
+		if(flag == flags.end())
+			return dflt;
+
+		char* end = nullptr;
+		const std::string& value = flag->second;
+		std::uint64_t n = std::strtoull(value.c_str(), &end, 10);
+		switch(end ? std::toupper(static_cast<unsigned char>(*end)) : 0){
+			case 'G': n <<= 10; [[fallthrough]];
+			case 'M': n <<= 10; [[fallthrough]];
+			case 'K': n <<= 10;
+		}
+		return n;
+	}
+
+	std::size_t Bro::cmd(const CmdTmpl& cmd, bool force){
+		if(!force && cmds.find(cmd.name) != cmds.end())
+			return std::numeric_limits<std::size_t>::max();
+
+		auto [ix, _] = cmds.emplace(cmd.name, cmd);
+		return ix;
+	}
+
+	std::size_t Bro::mod(std::string_view name){
+		std::string n{name};
+
+		if(mods.find(n) != mods.end())
+			return std::numeric_limits<std::size_t>::max();
+
+		auto [ix, ref] = mods.emplace(n, name);
+
+		return ix;
+	}
+
+	bool Bro::useCmd(std::size_t stage, std::size_t cmd, std::string_view ext){
+		if(stage >= stages.size() || cmd >= cmds.size())
+			return true;
+
+		return stages[stage]->add(ext, cmds[cmd]);
+	}
+
+	bool Bro::applyMod(std::size_t stage, std::size_t mod){
+		if(stage >= stages.size() || mod >= mods.size())
+			return true;
+
+		mods4stage[stage].insert(mod);
+		return false;
+	}
+
+	std::shared_ptr<const Scope> Bro::_scope() const {
+		std::unordered_map<std::string, std::vector<std::string>> vars;
+		for(const auto& [name, value]: flags)
+			vars[name] = {value};
+		return std::make_shared<const Scope>(std::move(vars));
+	}
+
+	std::uint64_t Bro::_fingerprint() const {
+		Hash h;
+
+		std::uint64_t sum = 0;
+		for(const auto& [name, value]: flags)
+			sum += Hash{}.update(name).update(value).digest();
+		h.update(sum);
+
+		for(std::size_t i = 0; i < stages.size(); i++){
+			stages[i]->hash(h);
+
+			auto applied = mods4stage.find(i);
+			if(applied == mods4stage.end())
+				continue;
+
+			std::vector<std::size_t> ixs(applied->second.begin(), applied->second.end());
+			std::sort(ixs.begin(), ixs.end());
+			for(std::size_t ix: ixs)
+				h.update(static_cast<std::uint64_t>(ix));
+			h.update(std::string_view{"|"});
+		}
+
+		for(const Module& mod: mods){
+			h.update(mod.name);
+			for(const auto* files: {&mod.files, &mod.deps}){
+				for(const Path& file: *files)
+					h.update(static_cast<std::uint64_t>(file.id));
+				h.update(std::string_view{"|"});
+			}
+			for(const auto& flag: mod.flags)
+				h.update(flag);
+			h.update(std::string_view{"|"});
+		}
+
+		return h.digest();
+	}
+
+	std::shared_ptr<const Graph> Bro::graph(){
+		std::uint64_t key = _fingerprint();
+		if(_graph && key == _graphKey)
+			return _graph;
+
+		Trace::Span span(trace, "apply stages");
+		std::shared_ptr<const Scope> flgs = _scope();
+		auto graph = std::make_shared<Graph>();
+		graph->produced.resize(mods.size());
+		for(const Module& mod: mods)
+			graph->moduleNames.push_back(mod.name);
+		for(const auto& stage: stages)
+			graph->stageNames.push_back(stage->name);
+
+		for(std::size_t i = 0; i < stages.size(); i++){
+			const Stage& stage = *stages[i];
+			auto applied = mods4stage.find(i);
+			if(applied == mods4stage.end())
+				continue;
+
+			for(std::size_t mod_ix: applied->second){
+				std::vector<Path>& produced = graph->produced[mod_ix];
+				for(CmdEntry& cmd: stage.apply(mods[mod_ix], produced, flgs)){
+					cmd.smart = true;
+					cmd.restat |= stage.restat;
+					if(!stage.pool.empty())
+						cmd.pool = stage.pool;
+					cmd.db = &db;
+					cmd.cache = &cache;
+					produced.push_back(cmd.output);
+					graph->add(std::move(cmd), mod_ix, i);
 				}
 			}
-				
-			return 0;
 		}
 
-		inline int ninja(){
-			std::ofstream out("build.ninja");
-			if(!out)
+		graph->connect();
+
+		_graph = graph;
+		_graphKey = key;
+		return _graph;
+	}
+
+	int Bro::build(){
+		std::filesystem::create_directory(flags["build"]);
+
+		std::shared_ptr<const Graph> graph = this->graph();
+
+		StatCache stats;
+		StatCache::Guard guard(stats);
+
+		{
+			Trace::Span span(trace, "open database");
+			if(db.open(log, std::filesystem::path(flags["build"]) / ".bro_db"))
 				return 1;
+		}
 
-			int ret = ninja(out);
+		db.content = getFlag("freshness", "mtime") == "hash";
 
-			out.close();
+		// cache=DIR enables the artifact cache, cache-size=N[KMG] bounds it
+		cache.dir = getFlag("cache");
+		cache.budget = getBytes("cache-size");
 
-			return ret;
+		// remote-cache=http://host[:port][/prefix] shares it with others
+		cache.remote = {};
+		if(hasFlag("remote-cache") && cache.remote.parse(getFlag("remote-cache"))){
+			log.error("Invalid remote cache URL: {}", getFlag("remote-cache"));
+			return 1;
 		}
 
-		inline int makefile(std::ostream& out){
-			std::unordered_set<std::string> dirs;
+		// Share job slots with the make above us and the ones we run, when
+		// joining one, its tokens limit us unless jobs is given
+		if(!jobserver.enabled() && isFlagSet("jobserver", true)){
+			const char* makeflags = std::getenv("MAKEFLAGS");
+			if(!makeflags || jobserver.connect(log, makeflags))
+				jobserver.serve(log, jobs());
+		}
 
-			out << ".DEFAULT_GOAL: all" << std::endl;
-			out << ".MAIN: all" << std::endl;
-			out << ".PHONY: default_goal" << std::endl;
-			out << "default_goal: all" << std::endl;
-			out << std::endl;
+		Scheduler sched{jobs(), keepGoing()};
+		if(jobserver.enabled() && !jobserver.serving() && !hasFlag("jobs"))
+			sched.jobs = std::numeric_limits<std::size_t>::max();
+		sched.jobserver = &jobserver;
+		sched.pools = pools;
 
-			std::vector<Module> mods = this->mods;
+		// memory=N[KMG] keeps the peak RSS the running commands reached last
+		// time below N, the cgroup's limit by default
+		sched.memory = getBytes("memory", Cgroup::memory());
 
-			for(const auto& stage: stages){
-				for(std::size_t mod_ix: mods4stage[stages.dict[stage->name]]){
-					Module& mod = mods[mod_ix];
-					for(const CmdEntry& cmd: stage->apply(mod)){
-						out << cmd.make() << std::endl;
-					}
-				}
+		// load=N starts fewer commands while the load average approaches N
+		sched.load = std::strtod(getFlag("load", "0").c_str(), nullptr);
+
+		auto skip = [&](std::size_t ix){
+			return mods[graph->modules[ix]].disabled;
+		};
+
+		// Made up front instead of by every entry
+		{
+			Trace::Span span(trace, "make directories");
+			std::unordered_set<std::string_view> dirs;
+			for(std::size_t i = 0; i < graph->nodes.size(); i++){
+				std::string_view out = graph->nodes[i].output.str();
+				std::size_t slash = out.rfind('/');
+				if(!skip(i) && slash != std::string_view::npos && dirs.insert(out.substr(0, slash)).second)
+					Directory(std::string(out.substr(0, slash))).make(log);
 			}
+		}
+
+		// Entries of disabled modules count as done
+		int ret;
+		{
+			Trace::Span span(trace, "run commands");
+			ret = graph->run(log, sched, skip, &trace);
+		}
+
+		{
+			Trace::Span span(trace, "finish");
+			cache.wait();
+			db.close();
+			cache.trim(log);
+		}
 
-			for(const auto& mod: mods){
-				out << ".PHONY: " << mod.name << std::endl;
-				out << mod.name << ":";
+		// trace=FILE, build/trace.json by default
+		if(trace.enabled){
+			std::string path = getFlag("trace");
+			trace.write(log, path == "yes" ? std::filesystem::path(flags["build"]) / "trace.json" : std::filesystem::path(path));
+		}
 
-				std::for_each(mod.files.begin() + this->mods[mod.name].files.size(), mod.files.end(), [&](const File& file){
-					dirs.insert(file.parent_path());
-					out << " " << file.string();
-				});
+		return ret;
+	}
 
-				out << std::endl << std::endl;
+	int Bro::run(){
+		bool dflt = false;
+		for(const auto& [name, mod]: mods.dict){
+			if(isFlagSet(name)){
+				dflt = true;
+				break;
 			}
+		}
 
-			out << "dirs :=";
-			for(const auto& dir: dirs)
-				out << " " << dir;
-			out << std::endl;
-			out << std::endl;
-			out << ".PHONY: all" << std::endl;
-			out << "all: $(dirs)";
-			for(const auto& mod: mods)
-				out << " " << mod.name;
-			out << std::endl;
+		for(Module& mod: mods)
+			mod.disabled = !isFlagSet(mod.name, !dflt);
+
+		// TODO: ninja
+		// TODO: make[file]
+
+		if(isFlagSet("clean", false))
+			// TODO: Add removing to API with Log
+			std::filesystem::remove_all(getFlag("build"));
+
+		return build();
+	}
+
+	int Bro::ninja(std::ostream& out){
+		std::shared_ptr<const Graph> graph = this->graph();
+		const std::vector<CmdEntry>& entries = graph->nodes;
+
+		for(const auto& [name, depth]: pools){
+			out << "pool " << name << std::endl;
+			out << "  depth = " << depth << std::endl;
 			out << std::endl;
-			out << "$(dirs):" << std::endl;
-			out << "\tmkdir -p $@" << std::endl;
+		}
+
+		// Rules whose entries get -MMD -MF appended take it from $depflags
+		std::unordered_set<std::string> depflags;
+		for(const CmdEntry& cmd: entries){
+			if(!cmd.depfile.empty() && !cmd.cmd.uses("depfile"))
+				depflags.insert(cmd.cmd.name);
+		}
+
+		for(const CmdTmpl& tmpl: cmds){
+			std::unordered_set<std::string> vars = tmpl.variables();
+			std::unordered_map<std::string, std::vector<std::string>> dict;
+			for(const auto& var: vars){
+				dict[var] = {"$" + var};
+			}
+
+			out << "rule " << tmpl.name << std::endl;
+			out << "  command = " << tmpl.compile(dict).str();
+			if(depflags.count(tmpl.name))
+				out << " $depflags";
 			out << std::endl;
-			out << ".PHONY: clean" << std::endl;
-			out << "clean:" << std::endl;
-			out << "\t$(RM) -r " << flags["build"] << std::endl;
 			out << std::endl;
-				
-			return 0;
 		}
 
-		inline int makefile(){
-			std::ofstream out("Makefile");
-			if(!out)
-				return 1;
+		// TODO: Phony targets
+		for(const CmdEntry& cmd: entries){
+			out << cmd.ninja() << std::endl;
+		}
+			
+		return 0;
+	}
 
-			int ret = makefile(out);
+	int Bro::ninja(){
+		std::ofstream out("build.ninja");
+		if(!out)
+			return 1;
 
-			out.close();
+		int ret = ninja(out);
 
-			return ret;
+		out.close();
+
+		return ret;
+	}
+
+	int Bro::makefile(std::ostream& out){
+		std::unordered_set<std::string> dirs;
+		std::vector<std::string> depfiles;
+
+		out << ".DEFAULT_GOAL: all" << std::endl;
+		out << ".MAIN: all" << std::endl;
+		out << ".PHONY: default_goal" << std::endl;
+		out << "default_goal: all" << std::endl;
+		out << std::endl;
+
+		std::shared_ptr<const Graph> graph = this->graph();
+		for(const CmdEntry& cmd: graph->nodes){
+			out << cmd.make() << std::endl;
+			if(!cmd.depfile.empty())
+				depfiles.push_back(cmd.depfile);
 		}
-	};
 
-	template<typename CharT, typename Traits>
-	inline std::basic_ostream<CharT, Traits>& operator<<(std::basic_ostream<CharT, Traits>& out, const File& file){
-		auto time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(file.time - std::filesystem::file_time_type::clock::now() + std::chrono::system_clock::now());
-		std::time_t tt = std::chrono::system_clock::to_time_t(time);
-		std::tm* tm = std::localtime(&tt);
-		return out << "bro::File{'exists': " << file.exists << ", 'path': " << file.path() << ", 'time': '" << std::put_time(tm, "%Y-%m-%d %H:%M:%S") << "'}";
+		for(std::size_t i = 0; i < mods.size(); i++){
+			out << ".PHONY: " << mods[i].name << std::endl;
+			out << mods[i].name << ":";
+
+			for(const Path& file: graph->produced[i]){
+				dirs.insert(std::filesystem::path(file.str()).parent_path());
+				out << " " << file;
+			}
+
+			out << std::endl << std::endl;
+		}
+
+		out << "dirs :=";
+		for(const auto& dir: dirs)
+			out << " " << dir;
+		out << std::endl;
+		out << std::endl;
+		out << ".PHONY: all" << std::endl;
+		out << "all: $(dirs)";
+		for(const auto& mod: mods)
+			out << " " << mod.name;
+		out << std::endl;
+		out << std::endl;
+		out << "$(dirs):" << std::endl;
+		out << "\tmkdir -p $@" << std::endl;
+		out << std::endl;
+		out << ".PHONY: clean" << std::endl;
+		out << "clean:" << std::endl;
+		out << "\t$(RM) -r " << flags["build"] << std::endl;
+		out << std::endl;
+
+		if(!depfiles.empty()){
+			out << "-include";
+			for(const auto& depfile: depfiles)
+				out << " " << depfile;
+			out << std::endl;
+		}
+			
+		return 0;
 	}
 
-	template<typename CharT, typename Traits>
-	inline std::basic_ostream<CharT, Traits>& operator<<(std::basic_ostream<CharT, Traits>& out, const CmdTmpl& tmpl){
-		out << "bro::CmdTmpl{'name': " << std::quoted(tmpl.name) << ", 'cmd': { ";
-		for(const auto& e: tmpl.cmd)
-			out << std::quoted(e) << " ";
-		return out << "}}";
+	int Bro::makefile(){
+		std::ofstream out("Makefile");
+		if(!out)
+			return 1;
+
+		int ret = makefile(out);
+
+		out.close();
+
+		return ret;
 	}
 }
+#endif
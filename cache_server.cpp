@@ -0,0 +1,12 @@
+#define BRO_IMPLEMENTATION
+#include "bro.hpp"
+
+// Reference server for the remote cache, e.g.:
+//   ./cache_server dir=.bro_cache port=8080
+//   ./bro remote-cache=http://127.0.0.1:8080
+int main(int argc, const char** argv){
+	bro::Bro bro(argc, argv);
+
+	bro::CacheServer server{bro.getFlag("dir", ".bro_cache"), bro.getFlag("host", "127.0.0.1"), bro.getFlag("port", "8080")};
+	return server.serve(bro.log);
+}